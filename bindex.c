@@ -8,20 +8,253 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sysexits.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 #include "mailbox.h"
+#include "watch.h"
 
-int main(int argc, char **argv)
+/* A mailbox being indexed by a child process, in batch mode */
+struct job {
+	const char *mailbox;
+	pid_t pid;
+	struct timeval start;
+};
+
+static void usage(void)
 {
-	if (argc != 2) {
-		fputs("Usage: bindex MAILBOX\n", stderr);
+	fputs("Usage: bindex [-t THREADS] [-j JOBS] MAILBOX...\n"
+	    "       bindex [-t THREADS] -w SPOOL\n"
+	    "       bindex [-t THREADS] -d MAILBOX < MESSAGE\n"
+	    "       bindex [-t THREADS] -r SUFFIX MAILBOX\n"
+	    "       bindex -z SUFFIX MAILBOX\n", stderr);
+	exit(1);
+}
+
+/*
+ * Returns MAILBOX_LOCKED if another process is updating the index, which
+ * then also indexes whatever we would have.
+ */
+static int index_mailbox(const char *mailbox)
+{
+	switch (mailbox_parse(mailbox)) {
+	case 0:
+		return 0;
+	case MAILBOX_LOCKED:
+		return MAILBOX_LOCKED;
+	}
+
+	fprintf(stderr, "Failed to parse the mailbox or/and its index file: %s\n", mailbox);
+	return 1;
+}
+
+/*
+ * Delivers a message from stdin.  Once it's in the mailbox, we report
+ * success even if we fail to update the index, as otherwise the message
+ * would be delivered again.
+ */
+static int deliver_message(const char *mailbox)
+{
+	switch (mailbox_deliver(mailbox, 0)) {
+	case 0:
+		return 0;
+	case -1:
+		fprintf(stderr, "Failed to deliver to the mailbox: %s\n", mailbox);
+		return EX_TEMPFAIL;
+	}
+
+	fprintf(stderr, "Failed to parse the mailbox or/and its index file: %s\n", mailbox);
+	return 0;
+}
+
+static int rotate_mailbox(const char *mailbox, const char *suffix)
+{
+	if (mailbox_rotate(mailbox, suffix)) {
+		fprintf(stderr, "Failed to rotate the mailbox: %s\n", mailbox);
 		return 1;
 	}
 
-	if (mailbox_parse(argv[1])) {
-		fprintf(stderr, "Failed to parse the mailbox or/and its index file: %s\n", argv[1]);
+	return 0;
+}
+
+static int compress_segment(const char *mailbox, const char *suffix)
+{
+	if (mailbox_compress(mailbox, suffix)) {
+		fprintf(stderr, "Failed to compress the segment: %s.%s\n",
+		    mailbox, suffix);
 		return 1;
 	}
 
 	return 0;
 }
+
+/*
+ * Waits for a child process to exit, and reports on it if it's one of the
+ * jobs.  Returns 1 if it was, 0 if it wasn't, or -1 if there's nothing to
+ * wait for.  Sets *error if the job failed.
+ */
+static int wait_job(struct job *jobs, int n, int *error)
+{
+	struct timeval now;
+	pid_t pid;
+	const char *what;
+	int i, status;
+
+	while ((pid = wait(&status)) < 0)
+		if (errno != EINTR)
+			return -1;
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < n; i++)
+		if (jobs[i].pid == pid)
+			break;
+	if (i >= n)
+		return 0;
+
+	jobs[i].pid = 0;
+	status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+	switch (status) {
+	case 0:
+		what = "indexed";
+		break;
+	case MAILBOX_LOCKED:
+		what = "skipped (locked)";
+		break;
+	default:
+		what = "failed";
+		*error = 1;
+	}
+	printf("%s: %s in %.3f s\n", jobs[i].mailbox, what,
+	    (double)(now.tv_sec - jobs[i].start.tv_sec) +
+	    (double)(now.tv_usec - jobs[i].start.tv_usec) / 1000000.0);
+	fflush(stdout);
+
+	return 1;
+}
+
+/*
+ * Indexes the mailboxes with up to max_jobs child processes at a time.
+ * Unmodified mailboxes are quickly skipped by mailbox_parse() as usual.
+ */
+static int index_mailboxes(char **mailboxes, int n, int max_jobs)
+{
+	struct job *jobs;
+	int i, running, status, error;
+
+	jobs = calloc(n, sizeof(*jobs));
+	if (!jobs) {
+		perror("calloc");
+		return 1;
+	}
+
+	error = 0;
+	running = 0;
+	for (i = 0; i < n; i++) {
+		while (running >= max_jobs &&
+		    (status = wait_job(jobs, i, &error)) >= 0)
+			running -= status;
+		if (running >= max_jobs)
+			break;
+
+		jobs[i].mailbox = mailboxes[i];
+		gettimeofday(&jobs[i].start, NULL);
+		fflush(stdout);
+		switch ((jobs[i].pid = fork())) {
+		case -1:
+			perror("fork");
+			error = 1;
+			jobs[i].pid = 0;
+			continue;
+		case 0:
+			_exit(index_mailbox(mailboxes[i]));
+		}
+		running++;
+	}
+
+	while (running > 0) {
+		if ((status = wait_job(jobs, n, &error)) < 0)
+			break;
+		running -= status;
+	}
+	if (running > 0 || i < n)
+		error = 1;
+
+	free(jobs);
+
+	return error;
+}
+
+int main(int argc, char **argv)
+{
+	int c, max_jobs = 0;
+	const char *spool = NULL, *deliver = NULL, *suffix = NULL;
+	const char *compress = NULL;
+
+	while ((c = getopt(argc, argv, "t:j:w:d:r:z:")) != -1) {
+		switch (c) {
+		case 't':
+			mailbox_threads = atoi(optarg);
+			if (mailbox_threads < 1 || mailbox_threads > 1024)
+				usage();
+			break;
+		case 'j':
+			max_jobs = atoi(optarg);
+			if (max_jobs < 1 || max_jobs > 1024)
+				usage();
+			break;
+		case 'w':
+			spool = optarg;
+			break;
+		case 'd':
+			deliver = optarg;
+			break;
+		case 'r':
+			suffix = optarg;
+			break;
+		case 'z':
+			compress = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (spool) {
+		if (argc != optind || max_jobs || deliver || suffix ||
+		    compress)
+			usage();
+		return watch_spool(spool) != 0;
+	}
+
+	if (deliver) {
+		if (argc != optind || max_jobs || suffix || compress)
+			usage();
+		return deliver_message(deliver);
+	}
+
+	if (compress) {
+		if (argc - optind != 1 || max_jobs || suffix)
+			usage();
+		return compress_segment(argv[optind], compress);
+	}
+
+	if (suffix) {
+		if (argc - optind != 1 || max_jobs)
+			usage();
+		return rotate_mailbox(argv[optind], suffix);
+	}
+
+	if (argc - optind < 1)
+		usage();
+
+	if (argc - optind == 1 && !max_jobs)
+		return index_mailbox(argv[optind]) == 1;
+
+	return index_mailboxes(&argv[optind], argc - optind,
+	    max_jobs ? max_jobs : 1);
+}
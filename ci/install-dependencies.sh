@@ -7,7 +7,7 @@
 
 j=-j`nproc` || j=
 type sudo >/dev/null 2>&1 && sudo=sudo || sudo=
-common_packages='make'
+common_packages='make zlib1g-dev'
 
 retry_if_failed()
 {
@@ -0,0 +1,671 @@
+/*
+ * Maildir and MH folders, which have a file per message.
+ * See folder.h for the descriptions.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "params.h"
+#include "misc.h"
+#include "index.h"
+#include "folder.h"
+
+#define FOLDER_SEEN			1	/* It's still there */
+#define FOLDER_DIRTY			2	/* Its record needs writing */
+
+/* A file's name in a sortable form, and its number */
+struct folder_key {
+	const char *key;
+	size_t length;
+	idx_off_t file;
+};
+
+/* Files we've found that aren't on the list yet */
+struct folder_new {
+	struct folder_file *files;
+	idx_off_t count, alloc;
+};
+
+/*
+ * Returns the part of a file's name that stays when it's renamed, which for
+ * a Maildir is the unique name without the "cur/" or "new/" and the flags.
+ */
+static size_t folder_key(const char *name, const char **key)
+{
+	const char *p;
+
+	if ((p = strchr(name, '/')))
+		name = p + 1;
+	*key = name;
+	if ((p = strchr(name, ':')))
+		return p - name;
+	return strlen(name);
+}
+
+/*
+ * Orders the keys by the numbers they start with (MH names are just that,
+ * and Maildir ones start with the time of delivery), and then as strings.
+ */
+static int key_cmp(const char *k1, size_t n1, const char *k2, size_t n2)
+{
+	size_t d1, d2;
+	int diff;
+
+	for (d1 = 0; d1 < n1 && k1[d1] >= '0' && k1[d1] <= '9'; d1++)
+		;
+	for (d2 = 0; d2 < n2 && k2[d2] >= '0' && k2[d2] <= '9'; d2++)
+		;
+	if (d1 != d2)
+		return d1 < d2 ? -1 : 1;
+
+	if ((diff = memcmp(k1, k2, n1 < n2 ? n1 : n2)))
+		return diff;
+	return n1 < n2 ? -1 : n1 > n2;
+}
+
+static int cmp_keys(const void *p1, const void *p2)
+{
+	const struct folder_key *k1 = p1, *k2 = p2;
+
+	return key_cmp(k1->key, k1->length, k2->key, k2->length);
+}
+
+static int cmp_files(const void *p1, const void *p2)
+{
+	const struct folder_file *f1 = p1, *f2 = p2;
+	const char *k1, *k2;
+	size_t n1, n2;
+
+	n1 = folder_key(f1->name, &k1);
+	n2 = folder_key(f2->name, &k2);
+
+	return key_cmp(k1, n1, k2, n2);
+}
+
+/* records what the file is like, which stays the same when it's renamed */
+static void folder_stat(struct folder_file *file, const struct stat *st)
+{
+	file->size = st->st_size;
+	file->mtime = st->st_mtime;
+	file->ino = st->st_ino;
+}
+
+static int folder_same(const struct folder_file *f1,
+    const struct folder_file *f2)
+{
+	return f1->size == f2->size && f1->mtime == f2->mtime &&
+	    f1->ino == f2->ino;
+}
+
+/*
+ * Returns the key of the file on the list that has the name and is the same
+ * file, or NULL if there's none.  There may be several by the name: a file
+ * that was replaced stays on the list until the index no longer has it.
+ */
+static const struct folder_key *folder_lookup(struct folder *folder,
+    const struct folder_key *keys, idx_off_t key_num,
+    const struct folder_key *key, const struct folder_file *file)
+{
+	const struct folder_key *found, *end;
+
+	found = bsearch(key, keys, key_num, sizeof(*keys), cmp_keys);
+	if (!found)
+		return NULL;
+	while (found > keys && !cmp_keys(found - 1, key))
+		found--;
+
+	for (end = keys + key_num; found < end && !cmp_keys(found, key);
+	    found++)
+		if (folder_same(&folder->files[found->file], file))
+			return found;
+
+	return NULL;
+}
+
+static int is_dir(const char *path, const char *name)
+{
+	struct stat st;
+	char *full;
+	int retval;
+
+	if (!(full = concat(path, "/", name, NULL)))
+		return 0;
+	retval = !stat(full, &st) && S_ISDIR(st.st_mode);
+	free(full);
+
+	return retval;
+}
+
+/*
+ * Looks through a directory of the folder ("new" or "cur" of a Maildir, or
+ * the MH folder itself) for files that are renamed or new.
+ */
+static int folder_scan(struct folder *folder, const char *subdir,
+    const struct folder_key *keys, idx_off_t key_num, struct folder_new *new)
+{
+	struct folder_key key;
+	const struct folder_key *found;
+	struct folder_file file;
+	struct dirent *entry;
+	struct stat st;
+	char *path, *name;
+	const char *p;
+	DIR *dir;
+	size_t n;
+	void *new_files;
+
+	if (!(path = concat(folder->path, "/", subdir, NULL)))
+		return -1;
+	dir = opendir(path);
+	free(path);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir(dir))) {
+		p = entry->d_name;
+		if (*p == '.')
+			continue;
+/* MH message files are named by their numbers, and nothing else is */
+		if (!folder->maildir) {
+			while (*p >= '0' && *p <= '9')
+				p++;
+			if (*p)
+				continue;
+		}
+
+		n = strlen(entry->d_name);
+		if (folder->maildir)
+			n += strlen(subdir) + 1;
+		if (n >= FOLDER_NAME_SIZE) {
+			fprintf(stderr, "Warning: skipping a file with too "
+			    "long a name: %s/%s\n", subdir, entry->d_name);
+			continue;
+		}
+
+/* It may have been removed since we've listed the directory */
+		if (fstatat(dirfd(dir), entry->d_name, &st, 0) ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		folder_stat(&file, &st);
+
+		key.length = folder_key(entry->d_name, &key.key);
+		found = folder_lookup(folder, keys, key_num, &key, &file);
+		if (found) {
+			name = folder->files[found->file].name;
+			if (folder->state[found->file] & FOLDER_SEEN)
+				continue;
+			folder->state[found->file] |= FOLDER_SEEN;
+		} else {
+			if (new->count >= new->alloc) {
+				new->alloc += new->alloc + 0x100;
+				new_files = realloc(new->files,
+				    (size_t)new->alloc * sizeof(*new->files));
+				if (!new_files) {
+					closedir(dir);
+					return -1;
+				}
+				new->files = new_files;
+			}
+			memcpy(&new->files[new->count], &file, sizeof(file));
+			name = new->files[new->count++].name;
+			*name = 0;
+		}
+
+/* A Maildir file's flags, and whether it's in "new" or "cur", may change */
+		if (folder->maildir) {
+			n = strlen(subdir);
+			if (strncmp(name, subdir, n) || name[n] != '/' ||
+			    strcmp(&name[n + 1], entry->d_name)) {
+				snprintf(name, FOLDER_NAME_SIZE, "%s/%s",
+				    subdir, entry->d_name);
+				if (found)
+					folder->state[found->file] |=
+					    FOLDER_DIRTY;
+			}
+		} else if (!found) {
+			strcpy(name, entry->d_name);
+		}
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/* appends the files we've found to the list, in order */
+static int folder_append(struct folder *folder, struct folder_new *new)
+{
+	idx_off_t i, n;
+	void *p;
+
+	if (!new->count)
+		return 0;
+
+	qsort(new->files, new->count, sizeof(*new->files), cmp_files);
+
+/* A file renamed as we were looking may have been seen twice */
+	for (i = n = 1; i < new->count; i++) {
+		if (!cmp_files(&new->files[n - 1], &new->files[i]))
+			continue;
+		if (n != i)
+			memcpy(&new->files[n], &new->files[i],
+			    sizeof(*new->files));
+		n++;
+	}
+
+	if (folder->count + n > IDX_FILES_MAX) {
+		fprintf(stderr, "Too many files in the folder\n");
+		return -1;
+	}
+
+	p = realloc(folder->files, (size_t)(folder->count + n) *
+	    sizeof(*folder->files));
+	if (!p)
+		return -1;
+	folder->files = p;
+	p = realloc(folder->state, (size_t)(folder->count + n));
+	if (!p)
+		return -1;
+	folder->state = p;
+
+	memcpy(&folder->files[folder->count], new->files,
+	    (size_t)n * sizeof(*folder->files));
+	memset(&folder->state[folder->count], FOLDER_SEEN | FOLDER_DIRTY, n);
+	folder->count += n;
+
+	return 0;
+}
+
+/*
+ * Reads the list of files at path, creating it with O_CREAT in flags, or
+ * else leaving it empty (with fd -1) if there's none.
+ */
+static int folder_read(struct folder *folder, const char *path, int flags)
+{
+	struct stat st;
+	char *name;
+	size_t size;
+	idx_off_t i;
+	int error;
+
+	memset(folder, 0, sizeof(*folder));
+	folder->fd = -1;
+
+	folder->path = strdup(path);
+	name = concat(path, FILES_FILENAME_SUFFIX, NULL);
+	if (name && folder->path)
+		folder->fd = open(name, O_RDWR | flags, 0644);
+	free(name);
+	if (folder->fd < 0 && errno == ENOENT && !(flags & O_CREAT) &&
+	    folder->path)
+		return 0;
+	if (folder->fd < 0 || fstat(folder->fd, &st))
+		return -1;
+
+/* Ignore a trailing partial record, if any; we'll overwrite it */
+	folder->count = folder->listed = st.st_size / sizeof(*folder->files);
+	size = (size_t)folder->count * sizeof(*folder->files);
+	error = folder->count > IDX_FILES_MAX ||
+	    size / sizeof(*folder->files) != folder->count;
+	if (!error) {
+		folder->files = malloc(size + 1);
+		folder->state = calloc(folder->count + 1, 1);
+		error = !folder->files || !folder->state ||
+		    read_loop(folder->fd, folder->files, size) != size;
+	}
+	for (i = 0; !error && i < folder->count; i++)
+		folder->files[i].name[FOLDER_NAME_SIZE - 1] = 0;
+
+	return error ? -1 : 0;
+}
+
+int folder_open(struct folder *folder, const char *path)
+{
+	struct folder_key *keys;
+	struct folder_new new;
+	idx_off_t i, n;
+	int error;
+
+	if (folder_read(folder, path, O_CREAT)) {
+		folder_close(folder, 0);
+		return -1;
+	}
+
+	folder->maildir = is_dir(path, "cur") && is_dir(path, "new");
+
+	keys = NULL;
+	error = 0;
+	if (folder->count)
+		error = !(keys = malloc((size_t)folder->count * sizeof(*keys)));
+	for (i = n = 0; !error && i < folder->count; i++) {
+		if (!folder->files[i].name[0])
+			continue;
+		keys[n].length = folder_key(folder->files[i].name,
+		    &keys[n].key);
+		keys[n++].file = i;
+	}
+	if (!error && n)
+		qsort(keys, n, sizeof(*keys), cmp_keys);
+
+/*
+ * Look in "new" first, so that a message moved to "cur" as we're looking
+ * is seen at least once
+ */
+	memset(&new, 0, sizeof(new));
+	if (!error && folder->maildir)
+		error = folder_scan(folder, "new", keys, n, &new) ||
+		    folder_scan(folder, "cur", keys, n, &new);
+	else if (!error)
+		error = folder_scan(folder, ".", keys, n, &new);
+	free(keys);
+
+	for (i = 0; !error && i < folder->count; i++)
+		if (folder->files[i].name[0] &&
+		    !(folder->state[i] & FOLDER_SEEN))
+			folder->missing = 1;
+
+	if (!error)
+		error = folder_append(folder, &new);
+	free(new.files);
+
+	if (error) {
+		folder_close(folder, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+const char *folder_name(struct folder *folder, idx_off_t file)
+{
+	if (file < 0 || file >= folder->count ||
+	    !(folder->state[file] & FOLDER_SEEN))
+		return NULL;
+
+	return folder->files[file].name;
+}
+
+/* writes the records of files from number file on that have the flag */
+static int folder_write(struct folder *folder, idx_off_t file, int flag)
+{
+	idx_off_t end;
+	size_t size;
+	int written = 0;
+
+	for (; file < folder->count; file = end) {
+		if (!(folder->state[file] & flag)) {
+			end = file + 1;
+			continue;
+		}
+		for (end = file + 1; end < folder->count; end++)
+			if (!(folder->state[end] & flag))
+				break;
+
+		size = (size_t)(end - file) * sizeof(*folder->files);
+		if (lseek(folder->fd, file * sizeof(*folder->files),
+		    SEEK_SET) < 0 ||
+		    write_loop(folder->fd, &folder->files[file], size) != size)
+			return -1;
+		written = 1;
+	}
+
+	return written;
+}
+
+int folder_save(struct folder *folder)
+{
+	idx_off_t i;
+	int written;
+
+/* The index will refer to these files by number, so have them on disk */
+	written = folder_write(folder, 0, FOLDER_DIRTY);
+	if (written < 0 || (written && fsync(folder->fd)))
+		return -1;
+
+	for (i = 0; i < folder->count; i++)
+		folder->state[i] &= ~FOLDER_DIRTY;
+	folder->listed = folder->count;
+
+	return 0;
+}
+
+void folder_close(struct folder *folder, int done)
+{
+	idx_off_t i;
+
+	if (done && folder->missing) {
+		for (i = 0; i < folder->listed; i++) {
+			if (!folder->files[i].name[0] ||
+			    (folder->state[i] & FOLDER_SEEN))
+				continue;
+			memset(&folder->files[i], 0, sizeof(folder->files[i]));
+			folder->state[i] |= FOLDER_DIRTY;
+		}
+		if (folder_write(folder, 0, FOLDER_DIRTY) < 0)
+			fprintf(stderr, "Warning: failed to update the list "
+			    "of files\n");
+	}
+
+	if (folder->fd >= 0)
+		close(folder->fd);
+	free(folder->state);
+	free(folder->files);
+	free(folder->path);
+	memset(folder, 0, sizeof(*folder));
+	folder->fd = -1;
+}
+
+/* looks for the Maildir file with the key in a directory of the folder */
+static int folder_find(const char *path, const char *subdir,
+    const char *key, size_t length)
+{
+	struct dirent *entry;
+	char *dir_path, *name;
+	const char *p;
+	DIR *dir;
+	int fd = -1;
+
+	if (!(dir_path = concat(path, "/", subdir, NULL)))
+		return -1;
+	dir = opendir(dir_path);
+	if (!dir) {
+		free(dir_path);
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		p = entry->d_name;
+		if (strncmp(p, key, length) || (p[length] && p[length] != ':'))
+			continue;
+		if ((name = concat(dir_path, "/", p, NULL))) {
+			fd = open(name, O_RDONLY);
+			free(name);
+		}
+		break;
+	}
+
+	closedir(dir);
+	free(dir_path);
+
+	return fd;
+}
+
+int folder_open_file(const char *path, const char *name)
+{
+	const char *key;
+	size_t length;
+	char *full;
+	int fd;
+
+	if (!(full = concat(path, "/", name, NULL)))
+		return -1;
+	fd = open(full, O_RDONLY);
+	free(full);
+	if (fd >= 0 || errno != ENOENT || !strchr(name, '/'))
+		return fd;
+
+	length = folder_key(name, &key);
+	if ((fd = folder_find(path, "cur", key, length)) < 0 &&
+	    (fd = folder_find(path, "new", key, length)) < 0)
+		errno = ENOENT;
+
+	return fd;
+}
+
+int folder_segments(struct folder *folder, const char *mailbox)
+{
+	if (folder_read(folder, mailbox, 0)) {
+		folder_close(folder, 0);
+		return -1;
+	}
+
+	if (folder->count)
+		memset(folder->state, FOLDER_SEEN, folder->count);
+
+	return 0;
+}
+
+int folder_add(struct folder *folder, const char *name)
+{
+	struct folder_new new;
+	struct folder_file record;
+	char *list;
+
+	if (strlen(name) >= sizeof(record.name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (folder->fd < 0) {
+		list = concat(folder->path, FILES_FILENAME_SUFFIX, NULL);
+		if (list)
+			folder->fd = open(list, O_CREAT | O_RDWR, 0644);
+		free(list);
+		if (folder->fd < 0)
+			return -1;
+	}
+
+	memset(&record, 0, sizeof(record));
+	strcpy(record.name, name);
+	new.files = &record;
+	new.count = new.alloc = 1;
+
+	return folder_append(folder, &new) || folder_save(folder) ? -1 : 0;
+}
+
+char *folder_segment_path(const char *mailbox, const char *name)
+{
+	const char *p;
+	char *dir, *path;
+
+	if (*name == '/' || !(p = strrchr(mailbox, '/')))
+		return strdup(name);
+
+	if (!(dir = strdup(mailbox)))
+		return NULL;
+	dir[p - mailbox + 1] = 0;
+	path = concat(dir, name, NULL);
+	free(dir);
+
+	return path;
+}
+
+/* opens a folder's file on the list, if it's still the one listed */
+static int folder_open_listed(const char *path,
+    const struct folder_file *listed)
+{
+	struct folder_file file;
+	struct stat st;
+	int fd;
+
+	if ((fd = folder_open_file(path, listed->name)) < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+/* Don't show another message that has taken the name until it's indexed */
+	folder_stat(&file, &st);
+	if (!folder_same(&file, listed)) {
+		close(fd);
+		errno = ENOENT;
+		return -1;
+	}
+
+	return fd;
+}
+
+int folder_open_data(const char *mailbox, idx_off_t *offset)
+{
+	struct folder_file listed;
+	struct stat st;
+	char *list, *path = NULL;
+	int fd, list_fd, dir;
+	off_t pos;
+
+	fd = open(mailbox, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	dir = S_ISDIR(st.st_mode);
+
+	if (!(list = concat(mailbox, FILES_FILENAME_SUFFIX, NULL))) {
+		close(fd);
+		return -1;
+	}
+	list_fd = open(list, O_RDONLY);
+	free(list);
+/* An mbox that's never been rotated has all of the messages in it */
+	if (list_fd < 0 && !dir && errno == ENOENT)
+		return fd;
+	if (list_fd < 0) {
+		close(fd);
+		return -1;
+	}
+
+	pos = IDX_FILE(*offset) * sizeof(listed);
+	*offset = IDX_FILE_OFFSET(*offset);
+	switch (pread(list_fd, &listed, sizeof(listed), pos)) {
+	case sizeof(listed):
+		if (!listed.name[0] || listed.name[sizeof(listed.name) - 1])
+			break;
+		close(fd);
+		fd = -1;
+		if (dir)
+			fd = folder_open_listed(mailbox, &listed);
+		else if ((path = folder_segment_path(mailbox, listed.name)))
+			fd = open(path, O_RDONLY);
+		free(path);
+		close(list_fd);
+		return fd;
+
+	case 0:
+/* Past the older segments, the message is in the mbox itself */
+		if (!dir) {
+			close(list_fd);
+			return fd;
+		}
+	}
+
+	close(list_fd);
+	close(fd);
+
+	return -1;
+}
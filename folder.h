@@ -0,0 +1,108 @@
+/*
+ * Maildir and MH folders, which have a file per message, and the older
+ * segments of rotated mboxes.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#ifndef _BLISTS_FOLDER_H
+#define _BLISTS_FOLDER_H
+
+#include <sys/types.h>
+
+#include "index.h"
+
+/*
+ * The files of a folder are numbered in the order bindex first sees them in,
+ * and the numbers never change.  Each file has a record at that number in
+ * the FILES_FILENAME_SUFFIX file, with its name relative to the folder (such
+ * as "cur/1700000000.M1P2.host:2,S" or "123"), which is updated when bindex
+ * sees the file renamed, and cleared once it's gone.  The record also has
+ * what the file was like when it was listed: one by that name that differs
+ * in any of that is another file (MH reuses the numbers of removed
+ * messages), so the one listed counts as gone.
+ */
+#define FOLDER_NAME_SIZE		232	/* For records of 256 bytes */
+
+struct folder_file {
+	char name[FOLDER_NAME_SIZE];
+	idx_off_t size, mtime, ino;
+};
+
+struct folder {
+	char *path;		/* The directory (or the mbox), or NULL */
+	int fd;			/* The list of its files */
+	int maildir;		/* Whether it's a Maildir rather than MH */
+	struct folder_file *files; /* The list, by number */
+	unsigned char *state;	/* Whether we've seen each file, etc. */
+	idx_off_t count;	/* How many files are in the list, */
+	idx_off_t listed;	/* and how many of them in the file so far */
+	int missing;		/* Whether some of them are gone */
+};
+
+/*
+ * Reads the list of files of the folder at path, and scans the folder for
+ * files that aren't on the list yet, which are added to it, sorted by name.
+ * Returns 0, or -1 on error.
+ */
+extern int folder_open(struct folder *folder, const char *path);
+
+/*
+ * Returns the name of file number file, or NULL if it's gone.
+ */
+extern const char *folder_name(struct folder *folder, idx_off_t file);
+
+/*
+ * Writes the records of the files that are new to the list or renamed.
+ * Returns 0, or -1 on error.
+ */
+extern int folder_save(struct folder *folder);
+
+/*
+ * Clears the records of the files that are gone if the index no longer has
+ * their messages, and frees the list.
+ */
+extern void folder_close(struct folder *folder, int done);
+
+/*
+ * Opens the file of the folder at path by its name on the list, or if it's
+ * not there, whatever it's been renamed to in a Maildir.  Returns -1 if it's
+ * gone.
+ */
+extern int folder_open_file(const char *path, const char *name);
+
+/*
+ * When an mbox is rotated, it becomes the newest of its older segments,
+ * which are numbered like the files of a folder and listed by name (relative
+ * to the mbox's directory, unless absolute) in the same way.  The mbox that
+ * deliveries go to is the active segment, numbered after the older ones.
+ * Only the names of the segments are in their records.
+ *
+ * Reads the list of older segments of the mbox at path, if it's got any.
+ * Returns 0, or -1 on error.
+ */
+extern int folder_segments(struct folder *folder, const char *path);
+
+/*
+ * Adds a segment to the list and writes it out.  Returns 0, or -1 on error.
+ */
+extern int folder_add(struct folder *folder, const char *name);
+
+/*
+ * Returns the path to the segment of the mbox by its name on the list, in
+ * malloc(3)'ed memory, or NULL on error.
+ */
+extern char *folder_segment_path(const char *mailbox, const char *name);
+
+/*
+ * Opens the file with the message data at *offset in the mailbox, which is
+ * the mbox itself or one of its older segments, or the message's own file
+ * for a folder, and makes *offset relative to that file.  Returns -1 on
+ * error, or if a folder's file is no longer the one listed.
+ */
+extern int folder_open_data(const char *mailbox, idx_off_t *offset);
+
+#endif
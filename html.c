@@ -22,6 +22,8 @@
 #include "mime.h"
 #include "encoding.h"
 #include "misc.h"
+#include "folder.h"
+#include "zfile.h"
 #include "html.h"
 
 int html_flags = HTML_BODY;
@@ -442,15 +444,13 @@ int html_message(const char *list, unsigned int y, unsigned int m, unsigned int
 		free(list_file);
 		return html_error(NULL);
 	}
-	fd = open(list_file, O_RDONLY);
+	fd = folder_open_data(list_file, &offset);
 	free(list_file);
 	if (fd < 0) {
 		buffer_free(&src);
 		return html_error("mbox open error");
 	}
-	error =
-	    lseek(fd, offset, SEEK_SET) != offset ||
-	    read_loop(fd, src.start, size) != size;
+	error = zfile_pread(fd, src.start, size, offset) != size;
 	if (close(fd) || error || mime_init(&mime, &src)) {
 		buffer_free(&src);
 		return html_error("mbox read error");
@@ -754,15 +754,13 @@ int html_attachment(const char *list, unsigned int y, unsigned int m, unsigned i
 		free(list_file);
 		return html_error(NULL);
 	}
-	fd = open(list_file, O_RDONLY);
+	fd = folder_open_data(list_file, &offset);
 	free(list_file);
 	if (fd < 0) {
 		buffer_free(&src);
 		return html_error("mbox open error");
 	}
-	error =
-	    lseek(fd, offset, SEEK_SET) != offset ||
-	    read_loop(fd, src.start, size) != size;
+	error = zfile_pread(fd, src.start, size, offset) != size;
 	if (close(fd) || error || mime_init(&mime, &src)) {
 		buffer_free(&src);
 		return html_error("mbox read error");
@@ -106,6 +106,21 @@ int idx_write_header(int fd, off_t offset)
 	return write_loop(fd, &h, sizeof(h)) != sizeof(h);
 }
 
+/* where the data at offset is in the file, past the header */
+off_t idx_file_offset(off_t offset)
+{
+	return offset + sizeof(struct idx_header);
+}
+
+/* seek(+header) and write data, ensuring that it's written at whole */
+int idx_write_ok(int fd, off_t offset, const void *buffer, size_t count)
+{
+	offset += sizeof(struct idx_header);
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return 0;
+	return write_loop(fd, buffer, count) == count;
+}
+
 /* seek(+header) and read data */
 int idx_read(int fd, off_t offset, void *buffer, int count)
 {
@@ -25,6 +25,17 @@
 	((N_ADAY + 1) * sizeof(idx_msgnum_t) + \
 	(a) * sizeof(struct idx_message))
 
+/*
+ * Where a mailbox is a folder with a file per message, a message's offset
+ * has the number of its file in the bits from IDX_FILE_SHIFT up, and the
+ * offset in that file in those below.
+ */
+#define IDX_FILE_SHIFT			40
+#define IDX_FILES_MAX			((idx_off_t)1 << (63 - IDX_FILE_SHIFT))
+#define IDX_FILE(offset)		((offset) >> IDX_FILE_SHIFT)
+#define IDX_FILE_OFFSET(offset) \
+	((offset) & (((idx_off_t)1 << IDX_FILE_SHIFT) - 1))
+
 #define IDX_F_HAVE_MSGID		1
 #define IDX_F_HAVE_IRT			2
 #define IDX_F_FROM_TRUNC		4
@@ -46,7 +57,7 @@ struct idx_message {
 	idx_size_t size;
 	idx_hash_t msgid_hash;	/* Message-ID */
 	idx_hash_t irt_hash[3];	/* In-Reply-To and last few References */
-	struct {
+	struct idx_links {
 		idx_msgnum_t pn; /* prev */
 		idx_msgnum_t nn; /* next */
 		idx_ymd_t py, pm, pd;
@@ -70,6 +81,8 @@ extern int idx_check_header(int fd, off_t *offset_p);
 extern int idx_open(const char *idx_file);
 extern int idx_close(int fd);
 extern int idx_write_header(int fd, off_t offset);
+extern off_t idx_file_offset(off_t offset);
+extern int idx_write_ok(int fd, off_t offset, const void *buffer, size_t count);
 extern int idx_read(int fd, off_t offset, void *buffer, int count);
 extern int idx_read_ok(int fd, off_t offset, void *buffer, int count);
 extern int idx_read_aday_ok(int fd, int aday, void *buffer, int count);
@@ -11,25 +11,34 @@
  * There's ABSOLUTELY NO WARRANTY, express or implied.
  */
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
 #define _XOPEN_SOURCE_EXTENDED
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "md5/md5.h"
+#include "md5/md5x4.h"
 
 #include "params.h"
 #include "index.h"
 #include "buffer.h"
 #include "mime.h"
 #include "misc.h"
+#include "uring.h"
+#include "folder.h"
+#include "zfile.h"
 #include "mailbox.h"
 
 /*
@@ -42,16 +51,432 @@
  */
 static idx_msgnum_t num_by_aday[N_ADAY + 1];
 
+/*
+ * What we need to keep in memory for a message while we link the threads:
+ * the fields of struct idx_message other than its offset, size, and strings,
+ * which we call its "rest".  They're laid out the same way in both.
+ */
+struct mem_message {
+	idx_hash_t msgid_hash;
+	idx_hash_t irt_hash[3];
+	struct idx_links t;
+	idx_ymd_t y, m, d;
+	idx_flags_t flags;
+	idx_msgnum_t rest;	/* The number of its rest, see below */
+};
+
+#define MSG_SHARED_SIZE \
+	(offsetof(struct idx_message, strings) - \
+	offsetof(struct idx_message, msgid_hash))
+
+/* Make sure the above holds */
+typedef char mem_message_layout_check[
+    offsetof(struct mem_message, rest) >= MSG_SHARED_SIZE &&
+    offsetof(struct mem_message, flags) ==
+    offsetof(struct idx_message, flags) -
+    offsetof(struct idx_message, msgid_hash) ? 1 : -1];
+
+struct mem_rest {
+	idx_off_t offset;
+	idx_size_t size;
+	char strings[IDX_STRINGS_SIZE];
+};
+
 static idx_msgnum_t msg_num;	/* number of actual messages in msgs[] */
 static idx_msgnum_t msg_alloc;	/* (pre)allocated size of msgs[] (in messages) */
-static struct idx_message *msgs; /* flat array */
+static struct mem_message *msgs; /* flat array */
 static const char *list;
 
-struct mem_message {
-	struct idx_message *msg;
-	struct mem_message *next_hash;
+/*
+ * The rests of the messages, numbered in the order we got them in, are in
+ * segments: those of the messages we've read from the index or from a
+ * checkpoint are in that file, and those of the new ones are in spill files
+ * (or in memory if we can't create those), one segment per chunk of the
+ * mailbox parsed.  We only need the rests as we write the messages out.
+ */
+struct rest_segment {
+	idx_msgnum_t first, count;	/* The rest numbers in this segment */
+	struct mem_rest *mem;		/* The rests in memory, or */
+	int fd;				/* the file with them, */
+	off_t offset;			/* where they start in it, */
+	int full;			/* whether they're struct idx_message, */
+	int index;			/* and whether it's the index file */
+	char *window;			/* Some of the file's, or the write buffer */
+	idx_msgnum_t window_first, window_count;
+};
+
+static struct rest_segment *segs;
+static int seg_num;
+static idx_msgnum_t rest_num;	/* The number of rests in all segments */
+
+int mailbox_threads = 1;
+int mailbox_resident = 0;
+
+/*
+ * What we know about the index we've kept in memory after the last call,
+ * if any: which mailbox it's for, how much of the mailbox it covers, and
+ * what the index file looked like once we were done with it.
+ */
+static struct {
+	char *mailbox;
+	off_t offset;		/* As begin_inc_idx() would have it */
+	off_t idx_offset;	/* The mailbox offset in the index header */
+	dev_t idx_dev;
+	ino_t idx_ino;
+	off_t idx_size;
+	time_t idx_mtime;
+} resident;
+
+/*
+ * A message we've just appended to the mailbox ourselves, which the parser
+ * takes from memory rather than read it back from the file.
+ */
+static struct {
+	char *data;		/* NULL if there's none */
+	off_t offset;
+	size_t size;
+} delivered;
+
+/*
+ * The Message-ID hash table used while linking.  It's open addressing with
+ * linear probing, and it only needs to know the last two messages with each
+ * Message-ID: a reply links to the last one other than itself.  It also has
+ * the Message-IDs that have been looked up for replies, found or not, since
+ * a new message with one of those would change the existing links.
+ */
+struct mem_msgid {
+	idx_hash_t hash;
+	idx_msgnum_t last;	/* -1 if there's no such message (yet) */
+	idx_msgnum_t prev;	/* -1 if there's at most one */
+	unsigned int flags;	/* 0 for a free slot */
+};
+
+#define MSGID_F_USED			1
+#define MSGID_F_REFERENCED		2
+
+/*
+ * The thread index used while linking: each message starts out as a thread
+ * of its own, and threads are merged as replies get linked to them.
+ */
+struct mem_thread {
+	idx_msgnum_t id;	/* Leads to the thread's id (union-find) */
+	idx_msgnum_t tail;	/* Last in thread (for the id), -1 if looped */
+};
+
+/*
+ * We keep both tables in a file next to the index between runs, so that we
+ * only need to link the new messages, unless a new message has a Message-ID
+ * that was looked up before or the messages had to be re-sorted.  The file
+ * has this header, the Message-ID table, and one thread per message.
+ */
+#define LINKS_TAG			"blinks"
+#define LINKS_REVISION			1
+
+struct links_header {
+	char tag[6];
+	short revision;
+	idx_msgnum_t msg_num;	/* Messages linked, -1 while being updated */
+	idx_msgnum_t msgid_num;	/* Message-ID table slots used */
+	unsigned int mask;	/* Message-ID table size - 1 */
+	off_t offset;		/* The mailbox offset in the index header */
 };
 
+static struct {
+	int fd;
+	char *map;
+	size_t size;
+	int valid;		/* Whether the file has messages we can keep */
+	struct links_header *h;
+	struct mem_msgid *table;
+	struct mem_thread *threads;
+} links = { -1, NULL, 0, 0, NULL, NULL, NULL };
+
+/*
+ * While indexing a mailbox from scratch, we save the messages parsed so far
+ * to a checkpoint file every CHECKPOINT_BYTES of the mailbox, so that we can
+ * resume from there if we're interrupted.  The file has this header, then
+ * the messages in the order they were parsed in, not linked yet.
+ */
+#define CKPT_TAG			"bckpnt"
+#define CKPT_REVISION			1
+
+struct ckpt_header {
+	char tag[6];
+	short revision;
+	idx_msgnum_t msg_num;	/* Messages saved */
+	off_t offset;		/* Where to resume parsing the mailbox */
+};
+
+static struct {
+	int fd;
+	char *name;
+	idx_msgnum_t saved;	/* Messages in the file so far */
+} ckpt = { -1, NULL, 0 };
+
+/*
+ * We also keep a fingerprint of each FPRINT_BYTES region of the mailbox we've
+ * indexed, so that when the mailbox is modified other than by appending to
+ * it, we only need to reindex it from the first region that has changed.
+ * We compute them from the data as we parse it, and keep the lanes for the
+ * region that's only been partly indexed, so that we never read any of the
+ * mailbox just for these.  The file has this header, then the fingerprints
+ * in mailbox order.
+ */
+#define FPRINTS_TAG			"bfprts"
+#define FPRINTS_REVISION		2
+
+typedef unsigned char fprint_t[8];
+
+/* A fingerprint in the making, see fprint_mix_in() */
+struct fprint_lanes {
+	off_t offset;		/* Where the data mixed in ends, -1 if none */
+	unsigned long long h[4];
+	unsigned char word[32];	/* The data past the last 32 bytes mixed in */
+};
+
+struct fprints_header {
+	char tag[6];
+	short revision;
+	unsigned int region_size;
+	unsigned int count;	/* Regions with fingerprints */
+	struct fprint_lanes next; /* For the region after those, if offset */
+};
+
+/* The fingerprints of the regions we've seen whole, and where we're at */
+struct fprinter {
+	struct fprint_lanes lanes;
+	struct fprint_done {
+		unsigned int region;
+		fprint_t fp;
+	} *done;		/* In the order of the regions, maybe with gaps */
+	unsigned int count;
+};
+
+static struct {
+	char *name;
+	unsigned int keep;	/* How many of the fingerprints are still good */
+	int fd;			/* The mailbox we're fingerprinting, or -1 */
+	struct fprinter fp;
+} fprints = { NULL, 0, -1, { { -1, { 0 }, { 0 } }, NULL, 0 } };
+
+/*
+ * The Maildir or MH folder we're indexing, if the mailbox is one, with the
+ * list of its files.  Each file is parsed as if it were an mbox with a
+ * single message, and the messages' offsets have the files' numbers in them.
+ */
+static struct folder folder = { NULL, -1, 0, NULL, NULL, 0, 0, 0 };
+
+/*
+ * The older segments of the mbox we're indexing, if it's been rotated.  The
+ * messages' offsets have the numbers of the segments they're in, and the
+ * mbox itself is the active segment numbered after those; it's the only one
+ * that may change.
+ */
+static struct folder segments = { NULL, -1, 0, NULL, NULL, 0, 0, 0 };
+
+/* returns the offset in the index for the start of the active segment */
+static off_t active_base(void)
+{
+	return (off_t)segments.count << IDX_FILE_SHIFT;
+}
+
+/* returns the slot for this Message-ID hash, which may be a free one */
+static struct mem_msgid *msgid_slot(struct mem_msgid *table,
+    unsigned int mask, const idx_hash_t hash)
+{
+	unsigned int hv;
+
+	hv = (unsigned int)hash[0] | ((unsigned int)hash[1] << 8) |
+	    ((unsigned int)hash[2] << 16) | ((unsigned int)hash[3] << 24);
+	while (table[hv &= mask].flags &&
+	    memcmp(table[hv].hash, hash, sizeof(idx_hash_t)))
+		hv++;
+
+	return &table[hv];
+}
+
+static size_t links_size(unsigned int mask, idx_msgnum_t thread_num)
+{
+	return sizeof(struct links_header) +
+	    ((size_t)mask + 1) * sizeof(struct mem_msgid) +
+	    (size_t)thread_num * sizeof(struct mem_thread);
+}
+
+/* returns the number of threads there's room for in the file */
+static idx_msgnum_t links_thread_num(void)
+{
+	return (links.map + links.size - (char *)links.threads) /
+	    sizeof(struct mem_thread);
+}
+
+static void links_unmap(void)
+{
+	if (links.map) {
+		munmap(links.map, links.size);
+		links.map = NULL;
+	}
+}
+
+static int links_map(size_t size)
+{
+	links.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    links.fd, 0);
+	if (links.map == MAP_FAILED) {
+		links.map = NULL;
+		return -1;
+	}
+	links.size = size;
+	links.h = (struct links_header *)links.map;
+	links.table = (struct mem_msgid *)&links.h[1];
+	links.threads = (struct mem_thread *)&links.table[links.h->mask + 1];
+
+	return 0;
+}
+
+/*
+ * Maps the file (which mailbox_parse() has opened and locked for us), and
+ * checks whether it's in sync with the index we've got (which is msg_num
+ * messages, and the mailbox offset from its header).
+ */
+static void links_open(off_t offset)
+{
+	struct stat st;
+	struct links_header h;
+
+	links.valid = 0;
+	if (msg_num <= 0 || fstat(links.fd, &st) ||
+	    lseek(links.fd, 0, SEEK_SET) != 0 ||
+	    read_loop(links.fd, &h, sizeof(h)) != sizeof(h))
+		return;
+	if (memcmp(h.tag, LINKS_TAG, sizeof(h.tag)) ||
+	    h.revision != LINKS_REVISION ||
+	    h.msg_num != msg_num || h.offset != offset ||
+	    (h.mask & (h.mask + 1)) ||
+	    st.st_size != links_size(h.mask, h.msg_num))
+		return;
+
+	if (!links_map(st.st_size))
+		links.valid = 1;
+}
+
+/*
+ * Marks the file as in sync with an index of msg_num messages and this
+ * mailbox offset, or leaves it as is on errors, then unmaps it.
+ */
+static void links_close(off_t offset)
+{
+	if (links.map && offset >= 0) {
+		links.h->msg_num = msg_num;
+		links.h->offset = offset;
+	}
+	links_unmap();
+	links.valid = 0;
+}
+
+/*
+ * Resizes the file for a Message-ID table of mask + 1 slots and thread_num
+ * threads, keeping whatever's there unless we start over.  Growing just the
+ * thread table is cheap; the Message-ID table needs to be rebuilt, though.
+ */
+static int links_resize(unsigned int mask, idx_msgnum_t thread_num, int over)
+{
+	struct links_header h;
+	struct mem_msgid *table, *p;
+	struct mem_thread *threads;
+	idx_msgnum_t old_num;
+	size_t size;
+	char *buffer;
+	unsigned int i;
+	int error;
+
+	size = links_size(mask, thread_num);
+	if (over)
+		links_unmap();
+	if (links.map && mask == links.h->mask) {
+		links_unmap();
+		if (ftruncate(links.fd, size))
+			return -1;
+		return links_map(size);
+	}
+
+	buffer = calloc(1, size);
+	if (!buffer)
+		return -1;
+
+	if (links.map) {
+		memcpy(&h, links.h, sizeof(h));
+	} else {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.tag, LINKS_TAG, sizeof(h.tag));
+		h.revision = LINKS_REVISION;
+	}
+	h.msg_num = -1;
+	h.mask = mask;
+	memcpy(buffer, &h, sizeof(h));
+	table = (struct mem_msgid *)&buffer[sizeof(h)];
+	threads = (struct mem_thread *)&table[mask + 1];
+
+	if (links.map) {
+		for (i = 0, p = links.table; i <= links.h->mask; i++, p++)
+			if (p->flags)
+				memcpy(msgid_slot(table, mask, p->hash), p,
+				    sizeof(*p));
+		old_num = links_thread_num();
+		if (old_num > thread_num)
+			old_num = thread_num;
+		memcpy(threads, links.threads, old_num * sizeof(*threads));
+	}
+
+	links_unmap();
+	error = lseek(links.fd, 0, SEEK_SET) != 0 ||
+	    write_loop(links.fd, buffer, size) != size ||
+	    ftruncate(links.fd, size);
+	free(buffer);
+	if (error)
+		return -1;
+
+	return links_map(size);
+}
+
+/* returns the slot for this Message-ID hash, adding it if needed */
+static struct mem_msgid *msgid_get(const idx_hash_t hash)
+{
+	struct mem_msgid *slot;
+	unsigned int mask;
+
+	slot = msgid_slot(links.table, links.h->mask, hash);
+	if (slot->flags)
+		return slot;
+
+/* Keep the table at most 3/4 full */
+	mask = links.h->mask;
+	if (((unsigned long long)links.h->msgid_num + 1) * 4 >
+	    (mask + 1ULL) * 3) {
+		if (mask >= 0x7fffffff ||
+		    links_resize((mask << 1) | 1, links_thread_num(), 0))
+			return NULL;
+		slot = msgid_slot(links.table, links.h->mask, hash);
+	}
+
+	memcpy(slot->hash, hash, sizeof(idx_hash_t));
+	slot->last = slot->prev = -1;
+	slot->flags = MSGID_F_USED;
+	links.h->msgid_num++;
+
+	return slot;
+}
+
+/* returns the id of the thread that message i belongs to */
+static idx_msgnum_t thread_find(struct mem_thread *threads, idx_msgnum_t i)
+{
+	while (threads[i].id != i) {
+		threads[i].id = threads[threads[i].id].id;
+		i = threads[i].id;
+	}
+
+	return i;
+}
+
 struct parsed_message {
 	idx_off_t raw_offset;	/* Raw, with the "From " line */
 	idx_off_t data_offset;	/* Just the message itself */
@@ -63,50 +488,354 @@ struct parsed_message {
 	const char *from, *subject;
 };
 
-/* allocate new message in msgs[] */
-/* maintains msg_num global counter */
-static struct idx_message *msgs_grow(void)
+/* A range of the mailbox and the messages parsed from it */
+struct mailbox_chunk {
+	int fd;
+	off_t start, end;	/* The range, with end being the file size */
+	int to_eof;		/* Whether to proceed past end until EOF */
+	const char *prefix;	/* A "From " line to parse before the range */
+	int prefix_size;
+	off_t base;		/* What to add to the offsets for the index */
+	off_t file, last;	/* A range of the folder's files to parse */
+	int report;		/* Whether to report progress */
+	struct mem_message *msgs; /* flat array */
+	idx_msgnum_t msg_num, msg_alloc;
+	idx_msgnum_t msg_first;	/* The first one we've parsed, in msgs[] */
+	struct rest_segment seg; /* Their rests */
+	struct fprinter fp;	/* Fingerprints of the data */
+	off_t data_end;		/* Past the end of the last one's data, plus 1 */
+	off_t offset;		/* Where we actually stopped */
+	int error;
+	int threaded;		/* Whether it's being parsed by a thread */
+	pthread_t thread;
+};
+
+/* writes out the rests buffered for a spill file */
+static int seg_flush(struct rest_segment *seg)
+{
+	size_t size;
+
+	size = (size_t)seg->window_count * sizeof(struct mem_rest);
+	if (size && write_loop(seg->fd, seg->window, size) != size)
+		return -1;
+	seg->window_count = 0;
+
+	return 0;
+}
+
+static void seg_free(struct rest_segment *seg)
+{
+	free(seg->mem);
+	free(seg->window);
+/* The index and checkpoint files aren't ours to close */
+	if (seg->fd >= 0 && !seg->full)
+		close(seg->fd);
+	memset(seg, 0, sizeof(*seg));
+	seg->fd = -1;
+}
+
+/* forgets all rests, except for those of the first count messages in the
+ * index file or a checkpoint file (fd), if any */
+static void rests_reset(int fd, int index, idx_msgnum_t count)
+{
+	int i;
+
+	for (i = 0; i < seg_num; i++)
+		seg_free(&segs[i]);
+	seg_num = 0;
+	rest_num = 0;
+
+	if (count <= 0)
+		return;
+	if (!segs && !(segs = malloc(sizeof(*segs))))
+		return;
+	memset(segs, 0, sizeof(*segs));
+	segs->count = count;
+	segs->fd = fd;
+	segs->offset = index ? IDX2MSG(0) : sizeof(struct ckpt_header);
+	segs->full = 1;
+	segs->index = index;
+	seg_num = 1;
+	rest_num = count;
+}
+
+/* adds a chunk's segment to the rest, taking it over */
+static int rests_append(struct mailbox_chunk *chunk)
+{
+	struct rest_segment *new_segs;
+
+	if (!chunk->seg.count) {
+		seg_free(&chunk->seg);
+		return 0;
+	}
+
+	new_segs = realloc(segs, (seg_num + 1) * sizeof(*segs));
+	if (!new_segs)
+		return -1;
+	segs = new_segs;
+
+	chunk->seg.first = rest_num;
+	memcpy(&segs[seg_num++], &chunk->seg, sizeof(chunk->seg));
+	rest_num += chunk->seg.count;
+	memset(&chunk->seg, 0, sizeof(chunk->seg));
+	chunk->seg.fd = -1;
+
+	return 0;
+}
+
+/*
+ * Fills in the offset, size, and strings of *m from rest number n.  When we
+ * need to read a rest from a file right next to those we've read last, we
+ * also read those next to it in the direction we're going, which is usually
+ * backwards.  Otherwise, the messages have been re-sorted, and we read just
+ * the one.
+ */
+static int rest_get(idx_msgnum_t n, struct idx_message *m)
+{
+	struct rest_segment *seg;
+	struct mem_rest *rest;
+	size_t stride, size;
+	idx_msgnum_t first, count;
+	int i;
+
+	for (i = 0, seg = segs; i < seg_num; i++, seg++)
+		if (n >= seg->first && n - seg->first < seg->count)
+			break;
+	if (i >= seg_num)
+		return -1;
+
+	if (seg->mem) {
+		rest = &seg->mem[n - seg->first];
+	} else {
+		stride = seg->full ?
+		    sizeof(struct idx_message) : sizeof(struct mem_rest);
+		if (n < seg->window_first ||
+		    n - seg->window_first >= seg->window_count) {
+			if (!seg->window &&
+			    !(seg->window = malloc(FILE_BUFFER_SIZE)))
+				return -1;
+			count = FILE_BUFFER_SIZE / stride;
+			first = n;
+			if (n + 1 == seg->window_first)
+				first = n + 1 - count;
+			else if (n != seg->window_first + seg->window_count)
+				count = 1;
+			if (first < seg->first)
+				first = seg->first;
+			if (count > seg->first + seg->count - first)
+				count = seg->first + seg->count - first;
+			size = (size_t)count * stride;
+			if (seg->index ? !idx_read_ok(seg->fd, seg->offset +
+			    (off_t)(first - seg->first) * stride,
+			    seg->window, size) :
+			    pread(seg->fd, seg->window, size, seg->offset +
+			    (off_t)(first - seg->first) * stride) != size)
+				return -1;
+			seg->window_first = first;
+			seg->window_count = count;
+		}
+		rest = (struct mem_rest *)&seg->window[
+		    (size_t)(n - seg->window_first) * stride];
+		if (seg->full) {
+			memcpy(m, rest, sizeof(*m));
+			return 0;
+		}
+	}
+
+	m->offset = rest->offset;
+	m->size = rest->size;
+	memcpy(m->strings, rest->strings, sizeof(m->strings));
+
+	return 0;
+}
+
+/* adds a rest to the chunk's segment */
+static int rest_put(struct mailbox_chunk *chunk, const struct mem_rest *rest)
+{
+	struct rest_segment *seg = &chunk->seg;
+
+	if (seg->fd < 0) {
+		memcpy(&seg->mem[seg->count++], rest, sizeof(*rest));
+		return 0;
+	}
+
+	if (!seg->window && !(seg->window = malloc(FILE_BUFFER_SIZE)))
+		return -1;
+	memcpy(&seg->window[seg->window_count++ * sizeof(*rest)], rest,
+	    sizeof(*rest));
+	seg->count++;
+	if ((seg->window_count + 1) * sizeof(*rest) > FILE_BUFFER_SIZE)
+		return seg_flush(seg);
+
+	return 0;
+}
+
+/* creates a spill file for the rests, which is removed right away */
+static int spill_open(const char *mailbox)
+{
+	char *name;
+	int fd;
+
+	if (!(name = concat(mailbox, SPILL_FILENAME_SUFFIX "XXXXXX", NULL)))
+		return -1;
+	if ((fd = mkstemp(name)) >= 0 && unlink(name)) {
+		close(fd);
+		fd = -1;
+	}
+	free(name);
+
+	return fd;
+}
+
+/* make room for (at least) new_alloc messages in chunk->msgs[] */
+static int msgs_reserve(struct mailbox_chunk *chunk, idx_msgnum_t new_alloc)
 {
-	struct idx_message *new_msgs;
-	idx_msgnum_t new_num, new_alloc;
+	struct mem_message *new_msgs;
+	struct mem_rest *new_mem;
 	size_t new_size;
 
-	new_num = msg_num + 1;
+/*
+ * A chunk that continues msgs[] may have room for its messages already, but
+ * not for their rests yet
+ */
+	if (new_alloc <= chunk->msg_alloc) {
+		if (chunk->seg.fd >= 0 || chunk->seg.mem)
+			return 0;
+		new_alloc = chunk->msg_alloc;
+	}
+
+/* We keep the rests in memory unless we've got a spill file */
+	if (chunk->seg.fd < 0) {
+		new_size = (size_t)(new_alloc - chunk->msg_first) *
+		    sizeof(struct mem_rest);
+		if (new_size / sizeof(struct mem_rest) !=
+		    new_alloc - chunk->msg_first)
+			return -1;
+		new_mem = realloc(chunk->seg.mem, new_size);
+		if (!new_mem)
+			return -1;
+		chunk->seg.mem = new_mem;
+	}
+
+	new_size = (size_t)new_alloc * sizeof(struct mem_message);
+	if (new_size / sizeof(struct mem_message) != new_alloc)
+		return -1;
+	new_msgs = realloc(chunk->msgs, new_size);
+	if (!new_msgs)
+		return -1;
+	chunk->msgs = new_msgs;
+	chunk->msg_alloc = new_alloc;
+
+	return 0;
+}
+
+/* allocate new message in chunk->msgs[] */
+/* maintains chunk->msg_num counter */
+static struct mem_message *msgs_grow(struct mailbox_chunk *chunk)
+{
+	idx_msgnum_t new_num, step;
+
+	new_num = chunk->msg_num + 1;
 	if (new_num <= 0)
 		return NULL;
 
-	if (new_num > msg_alloc) {
-		new_alloc = msg_alloc + MSG_ALLOC_STEP;
-		if (new_num > new_alloc)
-			return NULL;
-		new_size = (size_t)new_alloc * sizeof(struct idx_message);
-		if (new_size / sizeof(struct idx_message) != new_alloc)
+/* Grow by half, so that we don't keep copying a huge array over and over */
+	if (new_num > chunk->msg_alloc) {
+		step = chunk->msg_alloc >> 1;
+		if (step < MSG_ALLOC_STEP)
+			step = MSG_ALLOC_STEP;
+		if (step > INT_MAX - chunk->msg_alloc)
+			step = INT_MAX - chunk->msg_alloc;
+		if (new_num > chunk->msg_alloc + step ||
+		    msgs_reserve(chunk, chunk->msg_alloc + step))
 			return NULL;
+	}
+
+	return &chunk->msgs[chunk->msg_num++];
+}
+
+/*
+ * Makes room for the messages we expect to find in size bytes of a chunk,
+ * given their average size.  We'd rather reserve a bit too much: pages of
+ * the array that we don't use are never touched.
+ */
+static void msgs_presize(struct mailbox_chunk *chunk, off_t size, off_t avg)
+{
+	off_t count;
+
+	count = size / avg;
+	count += (count >> 3) + MSG_ALLOC_STEP;
+	if (count > MAX_MAILBOX_MESSAGES)
+		count = MAX_MAILBOX_MESSAGES;
+	if (count <= INT_MAX - chunk->msg_num)
+		msgs_reserve(chunk, chunk->msg_num + count);
+}
+
+/* append the messages parsed from a chunk to msgs[], and their rests */
+static int msgs_append(struct mailbox_chunk *chunk)
+{
+	struct mem_message *new_msgs;
+	idx_msgnum_t new_num, i;
+	size_t new_size;
+
+	if (chunk->seg.fd >= 0 && seg_flush(&chunk->seg))
+		return -1;
+	for (i = chunk->msg_first; i < chunk->msg_num; i++)
+		chunk->msgs[i].rest += rest_num;
+	if (rests_append(chunk))
+		return -1;
+
+	if (!msgs) {
+		msgs = chunk->msgs;
+		msg_num = chunk->msg_num;
+		msg_alloc = chunk->msg_alloc;
+		chunk->msgs = NULL;
+		return 0;
+	}
+
+	new_num = msg_num + chunk->msg_num;
+	if (new_num < msg_num)
+		return -1;
+	if (new_num > msg_alloc) {
+		new_size = (size_t)new_num * sizeof(struct mem_message);
+		if (new_size / sizeof(struct mem_message) != new_num)
+			return -1;
 		new_msgs = realloc(msgs, new_size);
 		if (!new_msgs)
-			return NULL;
+			return -1;
 		msgs = new_msgs;
-		msg_alloc = new_alloc;
+		msg_alloc = new_num;
 	}
+	memcpy(&msgs[msg_num], chunk->msgs,
+	    (size_t)chunk->msg_num * sizeof(struct mem_message));
+	msg_num = new_num;
 
-	return &msgs[msg_num++];
+	free(chunk->msgs);
+	chunk->msgs = NULL;
+	return 0;
 }
 
-/* convert parsed_message into idx_message and append it into msgs[] */
-static int message_process(struct parsed_message *msg)
+/* convert parsed_message into mem_message and its rest, and append them */
+static int message_process(struct mailbox_chunk *chunk,
+    struct parsed_message *msg)
 {
-	struct idx_message *idx_msg;
+	struct mem_message *idx_msg;
+	struct mem_rest rest;
 	char *p;
 	size_t left;
 
-	idx_msg = msgs_grow();
+	idx_msg = msgs_grow(chunk);
 	if (!idx_msg)
 		return -1;
 
 	memset(idx_msg, 0, sizeof(*idx_msg));
+	memset(&rest, 0, sizeof(rest));
 
-	idx_msg->offset = msg->data_offset;
-	idx_msg->size = msg->data_size;
+	idx_msg->rest = chunk->seg.count;
+	rest.offset = msg->data_offset + chunk->base;
+	rest.size = msg->data_size;
+	if (chunk->data_end < rest.offset + rest.size + 1)
+		chunk->data_end = rest.offset + rest.size + 1;
 
 	if (msg->tm.tm_year >= (MIN_YEAR - 1900) &&
 	    msg->tm.tm_year <= (MAX_YEAR - 1900)) {
@@ -131,8 +860,8 @@ static int message_process(struct parsed_message *msg)
 		idx_msg->flags |= IDX_F_HAVE_REF_BASE * msg->have_irt;
 	}
 
-	p = idx_msg->strings;
-	left = sizeof(idx_msg->strings);
+	p = rest.strings;
+	left = sizeof(rest.strings);
 	if (msg->from) {
 		size_t n = strlen(msg->from) + 1;
 		if (n > left) {
@@ -168,77 +897,115 @@ static int message_process(struct parsed_message *msg)
 			memcpy(p, msg->subject, n);
 	}
 
-	return 0;
+	return rest_put(chunk, &rest);
+}
+
+/*
+ * Copies the fields that struct mem_message and struct idx_message share,
+ * given pointers to their msgid_hash, either way.
+ */
+static void msg_copy_shared(idx_hash_t *dst, const idx_hash_t *src)
+{
+	memcpy(dst, src, MSG_SHARED_SIZE);
+}
+
+/* copies what we keep in memory of a message from its struct idx_message */
+static void msg_compact(struct mem_message *dst, const struct idx_message *src)
+{
+	msg_copy_shared(&dst->msgid_hash, &src->msgid_hash);
+}
+
+/* the reverse of the above, for the struct idx_message with the rest */
+static void msg_expand(struct idx_message *dst, const struct mem_message *src)
+{
+	msg_copy_shared(&dst->msgid_hash, &src->msgid_hash);
 }
 
-/* rebuild next/prev thread links */
-static int msgs_link(void)
+/*
+ * Rebuilds next/prev thread links, or just links the messages from start_from
+ * on if the rest is already linked and we can keep their links.
+ */
+static int msgs_link(idx_msgnum_t start_from)
 {
 	idx_msgnum_t i;
-	struct idx_message *m, *lit, *seen;
+	struct mem_message *m, *lit;
 	unsigned int aday;
-	struct mem_message *pool, **hash, *irt;
-	unsigned int hv, hi;
-	unsigned int count;
+	struct mem_msgid *slot;
+	struct mem_thread *threads;
+	idx_msgnum_t irt, id, my_id;
+	unsigned int mask, hi;
+
+	if (!links.valid)
+		start_from = 0;
+
+/* A new message with a Message-ID that was looked up before would change
+ * the existing links */
+	for (i = start_from, m = msgs + start_from; start_from && i < msg_num;
+	    i++, m++) {
+		if (!(m->flags & IDX_F_HAVE_MSGID))
+			continue;
+		slot = msgid_slot(links.table, links.h->mask, m->msgid_hash);
+		if (slot->flags & MSGID_F_REFERENCED)
+			start_from = 0;
+	}
 
-	pool = calloc(msg_num, sizeof(*pool));
-	if (!pool)
-		return -1;
-	hash = calloc(0x10000, sizeof(*hash));
-	if (!hash) {
-		free(pool);
-		return -1;
+	if (start_from) {
+		if (links_resize(links.h->mask, msg_num, 0))
+			return -1;
+	} else {
+		for (mask = 0xffff; mask < 0x7fffffff &&
+		    mask / 4 * 3 < msg_num; )
+			mask = (mask << 1) | 1;
+		if (links_resize(mask, msg_num, 1))
+			return -1;
 	}
+	links.h->msg_num = -1;
 
-	for (i = 0, m = msgs; i < msg_num; i++, m++) {
+	for (i = start_from, m = msgs + start_from; i < msg_num; i++, m++) {
 		/* The following assignment eliminates link cycles that may
-		 * cause an infinite loop in incremental mode. */
-		m->t.nn = m->t.pn = 0;
+		 * cause an infinite loop in incremental mode, as well as
+		 * links to messages that are gone from the mailbox. */
+		memset(&m->t, 0, sizeof(m->t));
+		links.threads[i].id = links.threads[i].tail = i;
 		if (!(m->flags & IDX_F_HAVE_MSGID))
 			continue;
-		pool[i].msg = m;
-		hv = m->msgid_hash[0] | ((unsigned int)m->msgid_hash[1] << 8);
-		pool[i].next_hash = hash[hv];
-		hash[hv] = &pool[i];
+		if (!(slot = msgid_get(m->msgid_hash)))
+			return -1;
+		slot->prev = slot->last;
+		slot->last = i;
 	}
 
-	for (i = 0, m = msgs; i < msg_num; i++, m++) {
+	for (i = start_from, m = msgs + start_from; i < msg_num; i++, m++) {
 		if (!(m->flags & IDX_F_HAVE_IRT))
 			continue;
 		hi = 1;
 		do {
 			hi &= 3; /* 1, 2, 0 */
-			if (hi != 1 && !(m->flags & (IDX_F_HAVE_REF_BASE << hi))) {
-				irt = NULL;
+			irt = -1;
+			if (hi != 1 && !(m->flags & (IDX_F_HAVE_REF_BASE << hi)))
 				continue;
-			}
-			hv = m->irt_hash[hi][0] | ((unsigned int)m->irt_hash[hi][1] << 8);
-			irt = hash[hv];
-			while (irt) {
-				if (!memcmp(&m->irt_hash[hi], irt->msg->msgid_hash, sizeof(idx_hash_t)) && m != irt->msg)
-					break;
-				irt = irt->next_hash;
-			}
-		} while (!irt && (hi <<= 1));
-		if (!irt)
+			if (!(slot = msgid_get(m->irt_hash[hi])))
+				return -1;
+			slot->flags |= MSGID_F_REFERENCED;
+			irt = slot->last != i ? slot->last : slot->prev;
+		} while (irt < 0 && (hi <<= 1));
+		if (irt < 0)
 			continue;
 
-/* The following loop could be avoided by maintaining a thread index,
- * including a "last in thread" pointer for each thread, and pointers
- * from each message into the thread index. */
-		lit = seen = irt->msg;
-		count = 0;
-		while (lit->t.nn) {
-			aday = YMD2ADAY(lit->t.ny, lit->t.nm, lit->t.nd);
-			lit = &msgs[num_by_aday[aday] + lit->t.nn - 2];
-			if (lit == seen)
-				break;
-			if (!((count + 1) & count))
-				seen = lit;
-			count++;
-		}
-		if (lit->t.nn)
+/* Append this message (and whatever follows it already) to the parent's
+ * thread, unless that would loop or the thread is already looped */
+		threads = links.threads;
+		id = thread_find(threads, irt);
+		if (threads[id].tail < 0)
 			continue;
+		lit = &msgs[threads[id].tail];
+		my_id = thread_find(threads, i);
+		if (my_id == id) {
+			threads[id].tail = -1;
+		} else {
+			threads[my_id].id = id;
+			threads[id].tail = threads[my_id].tail;
+		}
 		aday = YMD2ADAY(lit->y, lit->m, lit->d);
 		m->t.py = lit->y;
 		m->t.pm = lit->m;
@@ -251,31 +1018,106 @@ static int msgs_link(void)
 		lit->t.nn = i + 2 - num_by_aday[aday];
 	}
 
-	free(hash);
-	free(pool);
-
 	return 0;
 }
 
-static int cmp_msgs_by_day(const void *p1, const void *p2)
+struct msg_key {
+	unsigned int aday;
+	idx_msgnum_t i;
+};
+
+static int cmp_msg_keys(const void *p1, const void *p2)
+{
+	const struct msg_key *k1 = p1, *k2 = p2;
+
+	if (k1->aday != k2->aday)
+		return k1->aday < k2->aday ? -1 : 1;
+	return k1->i < k2->i ? -1 : k1->i > k2->i;
+}
+
+/*
+ * Sorts msgs[start..msg_num-1] by day and merges them into the already
+ * sorted msgs[0..start-1].  Messages of the same day keep their order, so
+ * the existing messages' numbers within their days stay the same.  This is
+ * done in place, with just a key per message from the earliest day affected.
+ * Returns the index of the first message of the earliest day affected.
+ */
+static idx_msgnum_t msgs_merge(idx_msgnum_t start)
 {
-	const struct idx_message *m1 = p1, *m2 = p2;
+	struct msg_key *keys;
+	struct mem_message *m, tmp;
+	idx_msgnum_t n, i, j, k, lo, hi;
+	unsigned int aday, min_aday;
+
+	n = msg_num - start;
+	min_aday = N_ADAY;
+	for (i = start, m = &msgs[start]; i < msg_num; i++, m++) {
+		aday = YMD2ADAY(m->y, m->m, m->d);
+		if (aday < min_aday)
+			min_aday = aday;
+	}
 
-	if (m1->y != m2->y)
-		return (int)m1->y - (int)m2->y;
-	if (m1->m != m2->m)
-		return (int)m1->m - (int)m2->m;
-	return (int)m1->d - (int)m2->d;
+	/* find where the earliest day of the tail starts in the sorted part */
+	lo = 0; hi = start;
+	while (lo < hi) {
+		m = &msgs[lo + (hi - lo) / 2];
+		if (YMD2ADAY(m->y, m->m, m->d) < min_aday)
+			lo += (hi - lo) / 2 + 1;
+		else
+			hi = lo + (hi - lo) / 2;
+	}
+
+	keys = malloc((size_t)(msg_num - lo) * sizeof(*keys));
+	if (!keys)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		m = &msgs[start + i];
+		keys[i].aday = YMD2ADAY(m->y, m->m, m->d);
+		keys[i].i = start + i;
+	}
+	qsort(keys, n, sizeof(*keys), cmp_msg_keys);
+
+	/* merge from the end, putting the tail last within each day, so that
+	 * keys[k] says which message goes to msgs[lo + k] */
+	i = start; j = n; k = msg_num - lo;
+	while (j > 0) {
+		if (i > lo && YMD2ADAY(msgs[i - 1].y, msgs[i - 1].m,
+		    msgs[i - 1].d) > keys[j - 1].aday)
+			keys[--k].i = --i;
+		else
+			memcpy(&keys[--k], &keys[--j], sizeof(*keys));
+	}
+	while (k > 0)
+		keys[--k].i = --i;
+
+	/* move the messages into place, a cycle of the permutation at a time */
+	for (k = lo; k < msg_num; k++) {
+		if (keys[k - lo].i == k)
+			continue;
+		memcpy(&tmp, &msgs[k], sizeof(tmp));
+		for (i = k; (j = keys[i - lo].i) != k; i = j) {
+			memcpy(&msgs[i], &msgs[j], sizeof(*msgs));
+			keys[i - lo].i = i;
+		}
+		memcpy(&msgs[i], &tmp, sizeof(*msgs));
+		keys[i - lo].i = i;
+	}
+
+	free(keys);
+
+	return lo;
 }
 
 /* update messages-per-day array and rebuild thread links */
+/* returns 1 if the messages had to be re-sorted */
 static int msgs_final(idx_msgnum_t start_from)
 {
-	idx_msgnum_t i;
-	struct idx_message *m;
+	idx_msgnum_t i, first;
+	struct mem_message *m;
 	unsigned int aday, prev_aday;
+	int sorted = 0;
 
-retry:
 	prev_aday = 0;
 	if (start_from) {
 		for (i = 0; i < N_ADAY; i++) {
@@ -293,10 +1135,19 @@ retry:
 			fprintf(stderr, "Warning: date went backwards: "
 			    "%u -> %u (%04u/%02u/%02u), sorting... ",
 			    prev_aday, aday, MIN_YEAR + m->y, m->m, m->d);
-			qsort(msgs, msg_num, sizeof(*msgs), cmp_msgs_by_day);
+			first = msgs_merge(i);
+			if (first < 0) {
+				fprintf(stderr, "failed\n");
+				return -1;
+			}
 			fprintf(stderr, "done\n");
-			start_from = 0;
-			goto retry;
+			sorted = 1;
+/* Recount from the first message of the earliest day affected */
+			i = first;
+			m = msgs + first;
+			aday = YMD2ADAY(m->y, m->m, m->d);
+			memset(&num_by_aday[aday], 0,
+			    (N_ADAY + 1 - aday) * sizeof(*num_by_aday));
 		}
 		prev_aday = aday;
 
@@ -306,7 +1157,149 @@ retry:
 			num_by_aday[aday]--;
 	}
 
-	return msgs_link();
+	if (msgs_link(sorted ? 0 : start_from))
+		return -1;
+
+	return sorted;
+}
+
+/*
+ * Writes out the thread links of those of the first old_msg_num messages
+ * that have changed since we've read them from the index.
+ */
+static int write_changed_links(int idx_fd, idx_msgnum_t old_msg_num,
+    const char *old_links)
+{
+	idx_msgnum_t i;
+	size_t size = sizeof(msgs->t);
+
+	for (i = 0; i < old_msg_num; i++, old_links += size) {
+		if (!memcmp(&msgs[i].t, old_links, size))
+			continue;
+		if (!idx_write_ok(idx_fd,
+		    IDX2MSG(i) + offsetof(struct idx_message, t),
+		    &msgs[i].t, size))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* writes out the range of num_by_aday[] that differs from old_by_aday[] */
+static int write_changed_by_aday(int idx_fd, const idx_msgnum_t *old_by_aday)
+{
+	int first, last;
+
+	for (first = 0; first <= N_ADAY; first++)
+		if (num_by_aday[first] != old_by_aday[first])
+			break;
+	if (first > N_ADAY)
+		return 0;
+	for (last = N_ADAY; last > first; last--)
+		if (num_by_aday[last] != old_by_aday[last])
+			break;
+
+	return !idx_write_ok(idx_fd, first * sizeof(idx_msgnum_t),
+	    &num_by_aday[first], (last - first + 1) * sizeof(idx_msgnum_t));
+}
+
+/*
+ * Writes out the messages from first on, each with its rest, and returns the
+ * resulting index file size.  We go backwards, so that the rests may be read
+ * from the index file being written to, as long as no message has moved to
+ * a lower number than that of its rest.  msgs_merge() never moves them that
+ * way, but we check.  (When we write a new index file, it doesn't matter.)
+ * With io_uring, we keep writing up to MAILBOX_URING blocks while we prepare
+ * the next one; they're all above the rests we may still need to read.
+ */
+static off_t write_msgs(int idx_fd, idx_msgnum_t first)
+{
+	struct idx_message *buffer, *m;
+	struct uring *ring;
+	idx_msgnum_t lo, hi, i, n;
+	size_t *sizes, count;
+	off_t size;
+	int slots, slot;
+
+	if (seg_num && segs->index && segs->fd == idx_fd)
+		for (i = first; i < msg_num; i++)
+			if (msgs[i].rest < segs->count && msgs[i].rest > i)
+				return -1;
+
+	ring = NULL;
+	slots = 1;
+	if (MAILBOX_URING && msg_num - first > FILE_BUFFER_SIZE /
+	    sizeof(*buffer) && (ring = uring_open(MAILBOX_URING)))
+		slots = MAILBOX_URING;
+
+	n = FILE_BUFFER_SIZE / sizeof(*buffer);
+	buffer = malloc((size_t)slots * n * sizeof(*buffer));
+	sizes = calloc(slots, sizeof(*sizes));
+	if (!buffer || !sizes) {
+		if (ring)
+			uring_close(ring);
+		free(sizes);
+		free(buffer);
+		return -1;
+	}
+
+/* Just seek to the end if there's nothing to write */
+	size = -1;
+	if (first >= msg_num && idx_write_ok(idx_fd, IDX2MSG(msg_num), buffer, 0))
+		size = lseek(idx_fd, 0, SEEK_CUR);
+
+	for (hi = msg_num, slot = 0; hi > first; hi = lo) {
+		lo = hi - first > n ? hi - n : first;
+		count = (size_t)(hi - lo) * sizeof(*buffer);
+		if (ring && sizes[slot] &&
+		    uring_wait(ring, slot) != (ssize_t)sizes[slot]) {
+			sizes[slot] = 0;
+			size = -1;
+			break;
+		}
+		sizes[slot] = 0;
+		for (i = hi, m = &buffer[slot * n + (hi - lo)]; i-- > lo; ) {
+			memset(--m, 0, sizeof(*m));
+			if (rest_get(msgs[i].rest, m))
+				break;
+			msg_expand(m, &msgs[i]);
+		}
+		if (i >= lo) {
+			size = -1;
+			break;
+		}
+		if (ring) {
+			if (uring_write(ring, slot, idx_fd, &buffer[slot * n],
+			    count, idx_file_offset(IDX2MSG(lo))) ||
+			    uring_submit(ring)) {
+				size = -1;
+				break;
+			}
+			sizes[slot] = count;
+			if (hi == msg_num)
+				size = idx_file_offset(IDX2MSG(msg_num));
+			slot = (slot + 1) % slots;
+			continue;
+		}
+		if (!idx_write_ok(idx_fd, IDX2MSG(lo), buffer, count)) {
+			size = -1;
+			break;
+		}
+		if (hi == msg_num)
+			size = lseek(idx_fd, 0, SEEK_CUR);
+	}
+
+	if (ring) {
+		for (slot = 0; slot < slots; slot++)
+			if (sizes[slot] &&
+			    uring_wait(ring, slot) != (ssize_t)sizes[slot])
+				size = -1;
+		uring_close(ring);
+	}
+	free(sizes);
+	free(buffer);
+
+	return size;
 }
 
 /*
@@ -322,195 +1315,1256 @@ static inline int eq(const char *s1, size_t n1, const char *s2, size_t n2)
 	return !strncasecmp(s1, s2, n2);
 }
 
-/* read existing index file into memory (which is num_by_aday[] and msgs[]) */
-/* returns offset up to which the mailbox was indexed so far */
-static off_t begin_inc_idx(int idx_fd, int fd)
+/*
+ * Reads count message structs from the current position in fd a block at a
+ * time, into a new array for old->msgs[], only keeping what we need in memory
+ * (the rests stay in the file).  If limit is non-negative, only keeps those
+ * messages that end, along with the next one's "From ", before it.  Returns
+ * past the end of the last message's data, plus 1, or -1 on error.
+ */
+static off_t msgs_load(int fd, idx_msgnum_t count, off_t limit,
+    struct mailbox_chunk *old)
 {
-	struct idx_message m;
-	struct idx_message *mptr;
-	off_t mailbox_size;
-	off_t inc_ofs = 0;
-	int error = 0;
-
-	/* read messages-per-day array */
-	if (read_loop(idx_fd, &num_by_aday, sizeof(num_by_aday)) != sizeof(num_by_aday))
-		return 0;
-
-	msg_num = 0;
-	msg_alloc = 0;
-	msgs = NULL;
+	struct idx_message *buffer;
+	size_t size;
+	idx_msgnum_t i, j, n;
+	off_t data_end = 0;
 
+	size = (size_t)count * sizeof(struct mem_message);
+	if (size / sizeof(struct mem_message) != count)
+		return -1;
+	old->msgs = malloc(size);
+	buffer = malloc(FILE_BUFFER_SIZE);
+	if (!old->msgs || !buffer) {
+		free(buffer);
+		free(old->msgs);
+		old->msgs = NULL;
+		return -1;
+	}
+	old->msg_num = 0;
+	old->msg_alloc = count;
+
+	n = FILE_BUFFER_SIZE / sizeof(*buffer);
+	for (i = 0; i < count; i += n) {
+		if (n > count - i)
+			n = count - i;
+		size = (size_t)n * sizeof(*buffer);
+		if (read_loop(fd, buffer, size) != size) {
+			data_end = -1;
+			break;
+		}
 	/*
 	 * We cannot just get the last index entry to detect the offset up to
 	 * which the mailbox was indexed so far: the order of index entries
 	 * may have been changed by qsort() called from msgs_final().
-	 *
-	 * This will need to be re-worked to not read message structs one by
-	 * one (inefficient).
 	 */
-	while (read_loop(idx_fd, &m, sizeof(m)) == sizeof(m)) {
-		off_t new_inc_ofs = m.offset + m.size + 1;
-		if (new_inc_ofs > inc_ofs)
-			inc_ofs = new_inc_ofs;
-		mptr = msgs_grow();
-		if (!mptr) {
-			error = 1;
-			break;
-		}
-		memcpy(mptr, &m, sizeof(m));
-	}
-	if (!error) {
-		if ((mailbox_size = lseek(fd, 0, SEEK_END)) < 0)
-			return -1;
-		if (mailbox_size < inc_ofs) {
-/* XXX: This is also triggered when the mbox doesn't end with an empty line */
-			fprintf(stderr, "Warning: mailbox size reduced, "
-			    "performing full indexing\n");
-			error = 1;
+		for (j = 0; j < n; j++) {
+			off_t new_data_end =
+			    buffer[j].offset + buffer[j].size + 1;
+			if (limit >= 0 && new_data_end + 5 > limit)
+				continue;
+			if (new_data_end > data_end)
+				data_end = new_data_end;
+			msg_compact(&old->msgs[old->msg_num], &buffer[j]);
+			old->msgs[old->msg_num++].rest = i + j;
 		}
 	}
-	if (error) {
-		free(msgs);
-		return 0;
+	free(buffer);
+
+	if (data_end < 0) {
+		free(old->msgs);
+		old->msgs = NULL;
 	}
 
-	return inc_ofs;
+	return data_end;
 }
 
-static void message_header_hash(const char *p, const char *q, idx_hash_t *hash)
+/* mixes a 64-bit word into a fingerprint lane */
+static inline unsigned long long fprint_mix(unsigned long long h,
+    unsigned long long w)
 {
-	MD5_CTX ctx;
-	unsigned char hash_full[16];
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, p, q - p);
-	MD5_Final(hash_full, &ctx);
-	memcpy(hash, hash_full, sizeof(*hash));
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+static void fprint_start(struct fprint_lanes *l, off_t offset)
+{
+	l->offset = offset;
+	l->h[0] = 1;
+	l->h[1] = 2;
+	l->h[2] = 3;
+	l->h[3] = 4;
 }
 
 /*
- * The mailbox parsing routine.
- * We implement a state machine at the line fragment level (that is, full or
- * partial lines).  This is faster than dealing with individual characters
- * (we leave that job for libc) and it doesn't require ever loading entire
- * lines into memory.
+ * Mixes size more bytes of a region into its lanes.  A fingerprint only needs
+ * to tell a modified region from the original, and it needs to be a lot
+ * faster than parsing the region, so rather than use MD5, we mix the data
+ * into four independent lanes, 32 bytes at a time, however it's split into
+ * blocks (FPRINT_BYTES being a multiple of 32).
  */
-static int mailbox_parse_fd(int fd)
+static void fprint_mix_in(struct fprint_lanes *l, const char *data,
+    size_t size)
 {
-	struct stat stat;			/* File information */
-	struct parsed_message msg;		/* Message being parsed */
-	struct buffer premime;			/* Buffered raw headers */
-	struct mime_ctx mime;			/* MIME decoding context */
-	char *file_buffer, *line_buffer;	/* Our internal buffers */
-	off_t file_offset, line_offset;		/* Their offsets in the file */
-	off_t offset;				/* A line fragment's offset */
-	char *current, *next, *line;		/* Line pointers */
-	int block, saved, extra, length;	/* Internal block sizes */
-	int done, start, end;			/* Various boolean flags: */
-	int blank, header, body;		/* the state information */
-	off_t unindexed_size, inc_ofs;
+	unsigned long long w;
+	size_t have, take;
+	int j;
+
+	while (size) {
+		have = l->offset % 32;
+		if (!have && size >= 32) {
+			for (j = 0; j < 4; j++) {
+				memcpy(&w, &data[j * 8], sizeof(w));
+				l->h[j] = fprint_mix(l->h[j], w);
+			}
+			take = 32;
+		} else {
+			take = 32 - have;
+			if (take > size)
+				take = size;
+			memcpy(&l->word[have], data, take);
+			if (have + take == 32)
+				for (j = 0; j < 4; j++) {
+					memcpy(&w, &l->word[j * 8], sizeof(w));
+					l->h[j] = fprint_mix(l->h[j], w);
+				}
+		}
+		l->offset += take;
+		data += take;
+		size -= take;
+	}
+}
 
-	inc_ofs = lseek(fd, 0, SEEK_CUR);
-	if (inc_ofs < 0 || fstat(fd, &stat))
-		return 1;
-	unindexed_size = stat.st_size - inc_ofs;
-	if (!unindexed_size)
-		return 0;
-	if (unindexed_size < 0 || !S_ISREG(stat.st_mode) ||
-	    stat.st_size > MAX_MAILBOX_BYTES || (stat.st_size >> (sizeof(off_t) * 8 - 1)))
-		return 1;
+static void fprint_finish(struct fprint_lanes *l, fprint_t fp)
+{
+	unsigned long long w;
+	int j;
 
-	memset(&msg, 0, sizeof(msg));
+	w = 0;
+	for (j = 0; j < 4; j++)
+		w = fprint_mix(w, l->h[j]);
+	memcpy(fp, &w, sizeof(fprint_t));
+}
 
-	file_buffer = malloc(FILE_BUFFER_SIZE + LINE_BUFFER_SIZE);
-	if (!file_buffer)
-		return 1;
-	line_buffer = &file_buffer[FILE_BUFFER_SIZE];
+/* records the fingerprint of a region, forgetting any past it we've had */
+static void fprint_done(struct fprinter *f, unsigned int region,
+    const fprint_t fp)
+{
+	struct fprint_done *new_done;
+
+	while (f->count && f->done[f->count - 1].region >= region)
+		f->count--;
+	new_done = realloc(f->done, (f->count + 1) * sizeof(*f->done));
+	if (!new_done)
+		return;
+	f->done = new_done;
+	f->done[f->count].region = region;
+	memcpy(f->done[f->count++].fp, fp, sizeof(fprint_t));
+}
 
-	if (buffer_init(&premime, 0)) {
-		free(file_buffer);
-		return 1;
+/*
+ * Mixes in a block of the mailbox the parser has got at offset, picking up
+ * at the next region if it doesn't follow what we've had so far.
+ */
+static void fprint_feed(struct fprinter *f, off_t offset, const char *data,
+    size_t size)
+{
+	fprint_t fp;
+	off_t start, end;
+	size_t n;
+
+	if (f->lanes.offset != offset)
+		f->lanes.offset = -1;
+
+	while (size) {
+		if (f->lanes.offset < 0) {
+			start = (offset + FPRINT_BYTES - 1) / FPRINT_BYTES *
+			    FPRINT_BYTES;
+			if (start - offset >= size)
+				return;
+			data += start - offset;
+			size -= start - offset;
+			offset = start;
+			fprint_start(&f->lanes, offset);
+		}
+		end = (offset / FPRINT_BYTES + 1) * FPRINT_BYTES;
+		n = size;
+		if (n > end - offset)
+			n = end - offset;
+		fprint_mix_in(&f->lanes, data, n);
+		data += n;
+		size -= n;
+		offset += n;
+		if (offset == end) {
+			fprint_finish(&f->lanes, fp);
+			fprint_done(f, offset / FPRINT_BYTES - 1, fp);
+			fprint_start(&f->lanes, offset);
+		}
 	}
-	if (mime_init(&mime, &premime)) {
-		buffer_free(&premime);
-		free(file_buffer);
-		return 1;
+}
+
+/* computes the fingerprint of the mailbox region at offset from the file */
+static int fprint_region(int fd, off_t offset, char *buffer, fprint_t fp)
+{
+	struct fprint_lanes l;
+	off_t end;
+	size_t size;
+
+	fprint_start(&l, offset);
+	for (end = offset + FPRINT_BYTES; offset < end; offset += size) {
+		size = FILE_BUFFER_SIZE;
+		if (size > end - offset)
+			size = end - offset;
+		if (pread(fd, buffer, size, offset) != size)
+			return -1;
+		fprint_mix_in(&l, buffer, size);
 	}
+	fprint_finish(&l, fp);
 
-	file_offset = line_offset = offset = inc_ofs;	/* Start at inc_ofs, */
-	current = file_buffer; block = 0; saved = 0;	/* and empty buffers */
+	return 0;
+}
 
-	done = 0;	/* Haven't reached EOF or the original size yet */
-	end = 1;	/* Assume we've just seen a LF: parse a new line */
-	blank = 1;	/* Assume we've seen a blank line: look for "From " */
-	header = 0;	/* Not in message headers, */
-	body = 0;	/* and not in message body */
+/*
+ * Opens the fingerprints file, and reads its header into *h, or sets *h up
+ * for a new file if the one there is no good.  Returns the descriptor, or -1
+ * on error.
+ */
+static int fprints_open(int flags, struct fprints_header *h)
+{
+	int fd;
+
+	if ((fd = open(fprints.name, flags, 0644)) < 0)
+		return -1;
+
+	if (read_loop(fd, h, sizeof(*h)) != sizeof(*h) ||
+	    memcmp(h->tag, FPRINTS_TAG, sizeof(h->tag)) ||
+	    h->revision != FPRINTS_REVISION ||
+	    h->region_size != FPRINT_BYTES) {
+		memset(h, 0, sizeof(*h));
+		memcpy(h->tag, FPRINTS_TAG, sizeof(h->tag));
+		h->revision = FPRINTS_REVISION;
+		h->region_size = FPRINT_BYTES;
+		h->next.offset = -1;
+	}
+
+	return fd;
+}
 
 /*
- * The main loop.  Its first part extracts the line fragments, while the
- * second one manages the state flags and performs whatever is required
- * based on the state.  Unfortunately, splitting this into two functions
- * didn't seem to simplify the code.
+ * Checks the fingerprints against the mailbox (which is of mailbox_size), and
+ * returns the offset up to which it's unchanged, as far as we can tell.
  */
-	do {
+static off_t fprints_verify(int fd, off_t mailbox_size)
+{
+	struct fprints_header h;
+	fprint_t fp, saved;
+	char *buffer;
+	int fprints_fd;
+	unsigned int i;
+
+	fprints.keep = 0;
+	if ((fprints_fd = fprints_open(O_RDONLY, &h)) < 0)
+		return 0;
+
+	buffer = malloc(FILE_BUFFER_SIZE);
+	for (i = 0; buffer && i < h.count &&
+	    (off_t)(i + 1) * FPRINT_BYTES <= mailbox_size; i++) {
+		if (read_loop(fprints_fd, saved, sizeof(saved)) !=
+		    sizeof(saved) ||
+		    fprint_region(fd, (off_t)i * FPRINT_BYTES, buffer, fp) ||
+		    memcmp(fp, saved, sizeof(fp)))
+			break;
+	}
+	free(buffer);
+	close(fprints_fd);
+
+	fprints.keep = i;
+	return (off_t)i * FPRINT_BYTES;
+}
+
 /*
- * Part 1.
- * The line fragment extraction.
+ * Sets up for fingerprinting the mailbox as we parse it from offset on,
+ * picking up the lanes we've kept, if they're for that and still good.
  */
+static void fprints_resume(int fd, off_t offset)
+{
+	struct fprints_header h;
+	int fprints_fd;
+
+	fprints.fd = fd;
+	fprints.fp.lanes.offset = -1;
+	fprints.fp.count = 0;
+
+	if (fprints.keep != UINT_MAX ||
+	    (fprints_fd = fprints_open(O_RDONLY, &h)) < 0)
+		return;
+	if (h.next.offset == offset && offset / FPRINT_BYTES == h.count)
+		memcpy(&fprints.fp.lanes, &h.next, sizeof(h.next));
+	close(fprints_fd);
+}
 
-/* Look for the next LF in the file buffer */
-		if ((next = memchr(current, '\n', block))) {
-/* Found it: get the length of this piece, and check for buffered data */
-			length = ++next - current;
-			if (saved) {
-/* Have this line's beginning in the line buffer: combine them */
-				extra = LINE_BUFFER_SIZE - saved;
-				if (extra > length)
-					extra = length;
-				memcpy(&line_buffer[saved], current, extra);
-				current += extra; block -= extra;
-				length = saved + extra;
-				line = line_buffer;
-				offset = line_offset;
-				start = end; end = current == next;
-				saved = 0;
-			} else {
-/* Nothing in the line buffer: just process what we've got now */
-				line = current;
-				offset = file_offset - block;
-				start = end; end = 1;
-				current = next; block -= length;
-			}
-		} else {
-/* No more LFs in the file buffer */
-			if (saved || block <= LINE_BUFFER_SIZE) {
-/* Have this line's beginning in the line buffer: combine them */
-/* Not enough data to process right now: buffer it */
-				extra = LINE_BUFFER_SIZE - saved;
-				if (extra > block)
-					extra = block;
-				if (!saved)
-					line_offset = file_offset - block;
-				memcpy(&line_buffer[saved], current, extra);
-				current += extra; block -= extra;
-				saved += extra;
-				length = saved;
-				line = line_buffer;
-				offset = line_offset;
+/*
+ * Adds the fingerprints of the regions of the mailbox below offset that don't
+ * have them yet, replacing those past the first fprints.keep.  We've got them
+ * from the parser, unless it didn't see a region whole.  Also keeps the lanes
+ * for the region that offset is in, for the next time.
+ */
+static int fprints_update(int fd, off_t offset)
+{
+	struct fprints_header h;
+	struct fprinter *f = &fprints.fp;
+	fprint_t fp;
+	char *buffer;
+	int fprints_fd, error;
+	unsigned int i, j, n;
+
+	if ((fprints_fd = fprints_open(O_CREAT | O_RDWR, &h)) < 0)
+		return -1;
+
+/* Forget the fingerprints we can't keep before we replace them */
+	error = 0;
+	if (h.count > fprints.keep) {
+		h.count = fprints.keep;
+		h.next.offset = -1;
+		error = lseek(fprints_fd, 0, SEEK_SET) != 0 ||
+		    write_loop(fprints_fd, &h, sizeof(h)) != sizeof(h);
+	}
+
+	n = offset / FPRINT_BYTES;
+	if (!error && h.count < n) {
+		buffer = NULL;
+		error = lseek(fprints_fd,
+		    sizeof(h) + (off_t)h.count * sizeof(fp), SEEK_SET) < 0;
+		j = 0;
+		for (i = h.count; i < n && !error; i++) {
+			while (j < f->count && f->done[j].region < i)
+				j++;
+			if (j < f->count && f->done[j].region == i) {
+				memcpy(fp, f->done[j].fp, sizeof(fp));
 			} else {
-/* Nothing in the line buffer and we've got enough data: just process it */
-				length = block - 1;
-				line = current;
-				offset = file_offset - block;
-				current += length;
-				block = 1;
+				if (!buffer)
+					buffer = malloc(FILE_BUFFER_SIZE);
+				error = !buffer ||
+				    fprint_region(fd, (off_t)i * FPRINT_BYTES,
+				    buffer, fp);
 			}
-			if (!block) {
-/* We've emptied the file buffer: fetch some more data */
-				current = file_buffer;
-				block = read(fd, file_buffer, FILE_BUFFER_SIZE);
-				if (block < 0)
-					break;
-				file_offset += block;
+			error = error ||
+			    write_loop(fprints_fd, fp, sizeof(fp)) != sizeof(fp);
+		}
+		free(buffer);
+		h.count = n;
+	}
+
+/* The header goes last, once the fingerprints are there */
+	if (!error) {
+		memcpy(&h.next, &f->lanes, sizeof(h.next));
+		if (h.next.offset != offset || offset / FPRINT_BYTES != n)
+			h.next.offset = -1;
+		error = lseek(fprints_fd, 0, SEEK_SET) != 0 ||
+		    write_loop(fprints_fd, &h, sizeof(h)) != sizeof(h);
+	}
+
+	error |= close(fprints_fd);
+
+	return error ? -1 : 0;
+}
+
+/* takes over the fingerprints a chunk has got, which follow the first one's */
+static void fprints_append(struct mailbox_chunk *chunk)
+{
+	struct fprinter *f = &chunk->fp;
+	unsigned int i;
+
+	for (i = 0; i < f->count; i++)
+		fprint_done(&fprints.fp, f->done[i].region, f->done[i].fp);
+	memcpy(&fprints.fp.lanes, &f->lanes, sizeof(f->lanes));
+	free(f->done);
+	f->done = NULL;
+	f->count = 0;
+}
+
+/*
+ * Checks that the mailbox has a message start at offset, as it would if the
+ * previous message was followed by a blank line and a "From " line.
+ */
+static int mailbox_from_at(int fd, off_t offset)
+{
+	char from[7];
+
+	return offset >= 2 &&
+	    pread(fd, from, sizeof(from), offset - 2) == sizeof(from) &&
+	    !memcmp(from, "\n\nFrom ", sizeof(from));
+}
+
+/* opens the older segment number file, reporting it if it's not there */
+static int segment_open(off_t file)
+{
+	const char *name;
+	char *path;
+	int fd;
+
+	if (!(name = folder_name(&segments, file)) ||
+	    !(path = folder_segment_path(segments.path, name)))
+		return -1;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		perror(path);
+	free(path);
+
+	return fd;
+}
+
+/*
+ * Checks that the mailbox has a message start at offset as the index has it,
+ * in whichever segment that is, or that a segment other than the first one
+ * starts there.
+ */
+static int mailbox_start_at(int fd, off_t offset)
+{
+	off_t file = IDX_FILE(offset), pos = IDX_FILE_OFFSET(offset);
+	char from[7];
+	int retval;
+
+	if (!pos)
+		return file > 0 && file <= segments.count;
+	if (file == segments.count)
+		return mailbox_from_at(fd, pos);
+	if (file > segments.count || (fd = segment_open(file)) < 0)
+		return 0;
+/* An older segment may have been compressed */
+	retval = zfile_pread(fd, from, sizeof(from), pos - 2) ==
+	    sizeof(from) && !memcmp(from, "\n\nFrom ", sizeof(from));
+	close(fd);
+
+	return retval;
+}
+
+/*
+ * Checks whether the newest older segment of the mailbox is yet to be linked
+ * to it, or is still the same file, as it is if it's been rotated halfway.
+ */
+static int segment_is_active(int fd)
+{
+	struct stat st, seg_st;
+	char *path;
+	int retval;
+
+	if (!segments.count ||
+	    !(path = folder_segment_path(segments.path,
+	    folder_name(&segments, segments.count - 1))))
+		return 0;
+	if (lstat(path, &seg_st))
+		retval = errno == ENOENT;
+	else
+		retval = !stat(path, &seg_st) && !fstat(fd, &st) &&
+		    st.st_dev == seg_st.st_dev && st.st_ino == seg_st.st_ino;
+	free(path);
+
+	return retval;
+}
+
+/* returns the number of messages that num_by_aday[] accounts for */
+static idx_msgnum_t aday_total(void)
+{
+	int aday;
+
+	for (aday = N_ADAY - 1; aday >= 0; aday--)
+		if (num_by_aday[aday] > 0)
+			return num_by_aday[aday] - 1 +
+			    aday_count(&num_by_aday[aday]);
+
+	return 0;
+}
+
+/* read existing index file into memory (which is num_by_aday[] and msgs[]) */
+/* returns offset up to which the mailbox was indexed so far */
+/* sets *relink if the messages need to be linked (and sorted) all over */
+static off_t begin_inc_idx(int idx_fd, int fd, int *relink)
+{
+	struct mailbox_chunk old;
+	struct stat st;
+	off_t pos, count;
+	off_t mailbox_size, limit, base;
+	off_t inc_ofs = 0;
+	int error = 0;
+
+	/* read messages-per-day array */
+	if (read_loop(idx_fd, &num_by_aday, sizeof(num_by_aday)) != sizeof(num_by_aday))
+		return 0;
+
+	memset(&old, 0, sizeof(old));
+
+	/*
+	 * Read as many message structs as num_by_aday[] accounts for.  An
+	 * update that didn't complete may have left more past those, which we
+	 * drop, as num_by_aday[] is only written once they're all in place.
+	 */
+	if ((pos = lseek(idx_fd, 0, SEEK_CUR)) < 0 || fstat(idx_fd, &st))
+		return 0;
+	count = aday_total();
+	if (count < 0 ||
+	    pos + count * (off_t)sizeof(struct idx_message) > st.st_size)
+		return 0;
+	if (pos + count * (off_t)sizeof(struct idx_message) < st.st_size &&
+	    ftruncate(idx_fd, pos + count * sizeof(struct idx_message)))
+		return 0;
+	if (count && (inc_ofs = msgs_load(idx_fd, count, -1, &old)) < 0)
+		return 0;
+
+	if (!error && !folder.path) {
+		base = active_base();
+		if ((mailbox_size = lseek(fd, 0, SEEK_END)) < 0) {
+			free(old.msgs);
+			return -1;
+		}
+		if (base + mailbox_size < inc_ofs) {
+/*
+ * This is also triggered when the mbox doesn't end with an empty line, in
+ * which case we'll only reindex the last region.  Either way, keep the
+ * messages from the regions that are unchanged, if any.
+ */
+			free(old.msgs);
+			old.msgs = NULL;
+			limit = fprints_verify(fd, mailbox_size);
+			inc_ofs = -1;
+/* The older segments don't change, so their messages are always good */
+			if ((limit > 0 || base) &&
+			    lseek(idx_fd, pos, SEEK_SET) == pos)
+				inc_ofs = msgs_load(idx_fd, count, base + limit,
+				    &old);
+			if (inc_ofs >= 0 && inc_ofs < base)
+				inc_ofs = base;
+			if (inc_ofs > 0 && old.msg_num > 0 &&
+			    (inc_ofs == base ||
+			    mailbox_from_at(fd, inc_ofs - base))) {
+				fprintf(stderr, "Warning: mailbox modified, "
+				    "reindexing from %llu\n",
+				    (unsigned long long)(inc_ofs - base));
+				*relink = 1;
+			} else {
+				fprintf(stderr, "Warning: mailbox size reduced, "
+				    "performing full indexing\n");
+				error = 1;
+			}
+		}
+	}
+	if (error) {
+		free(old.msgs);
+		return 0;
+	}
+
+	msgs = old.msgs;
+	msg_num = old.msg_num;
+	msg_alloc = old.msg_alloc;
+	rests_reset(idx_fd, 1, count);
+
+	return inc_ofs;
+}
+
+/*
+ * Loads the messages saved to the checkpoint file into msgs[], if it's there
+ * and still matches the mailbox.  Returns the offset to resume parsing the
+ * mailbox at, with *data_end set as begin_inc_idx() would have it, or 0 to
+ * start over.
+ */
+static off_t ckpt_resume(int fd, off_t *data_end)
+{
+	struct mailbox_chunk old;
+	struct ckpt_header h;
+	struct stat st;
+	off_t end;
+
+	if ((ckpt.fd = open(ckpt.name, O_RDWR)) < 0)
+		return 0;
+
+	memset(&old, 0, sizeof(old));
+	end = -1;
+	if (!fstat(ckpt.fd, &st) &&
+	    read_loop(ckpt.fd, &h, sizeof(h)) == sizeof(h) &&
+	    !memcmp(h.tag, CKPT_TAG, sizeof(h.tag)) &&
+	    h.revision == CKPT_REVISION && h.msg_num > 0 &&
+	    (st.st_size - (off_t)sizeof(h)) / (off_t)sizeof(struct idx_message) >=
+	    h.msg_num && mailbox_start_at(fd, h.offset))
+		end = msgs_load(ckpt.fd, h.msg_num, -1, &old);
+	if (end < 0 || end > h.offset) {
+		free(old.msgs);
+		close(ckpt.fd);
+		ckpt.fd = -1;
+		return 0;
+	}
+
+	logtty("Resuming from checkpoint at %llu\n",
+	    (unsigned long long)h.offset);
+
+	msgs = old.msgs;
+	msg_num = old.msg_num;
+	msg_alloc = old.msg_alloc;
+	rests_reset(ckpt.fd, 0, msg_num);
+	ckpt.saved = msg_num;
+	*data_end = end;
+
+	return h.offset;
+}
+
+/*
+ * Saves the messages parsed since the last save to the checkpoint file, and
+ * then the offset to resume parsing the mailbox at.  Their rests are then
+ * read back from the file rather than kept in memory or in spill files.
+ */
+static int ckpt_save(off_t offset)
+{
+	struct ckpt_header h;
+	struct idx_message *buffer, *m;
+	idx_msgnum_t i, j, n;
+	size_t size;
+	int error = 0;
+
+	if (ckpt.fd < 0 &&
+	    (ckpt.fd = open(ckpt.name, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+		return -1;
+
+	n = FILE_BUFFER_SIZE / sizeof(*buffer);
+	buffer = malloc(n * sizeof(*buffer));
+	if (!buffer)
+		return -1;
+
+	for (i = ckpt.saved; i < msg_num && !error; i += n) {
+		if (n > msg_num - i)
+			n = msg_num - i;
+		for (j = 0, m = buffer; j < n; j++, m++) {
+			memset(m, 0, sizeof(*m));
+			if ((error = rest_get(msgs[i + j].rest, m)))
+				break;
+			msg_expand(m, &msgs[i + j]);
+		}
+		size = (size_t)n * sizeof(*buffer);
+		if (!error && (lseek(ckpt.fd, sizeof(h) + (off_t)i *
+		    sizeof(*buffer), SEEK_SET) < 0 ||
+		    write_loop(ckpt.fd, buffer, size) != size))
+			error = 1;
+	}
+
+	free(buffer);
+
+/* The header goes last, once the messages are on disk */
+	memset(&h, 0, sizeof(h));
+	memcpy(h.tag, CKPT_TAG, sizeof(h.tag));
+	h.revision = CKPT_REVISION;
+	h.msg_num = msg_num;
+	h.offset = offset;
+	if (error || fsync(ckpt.fd) || lseek(ckpt.fd, 0, SEEK_SET) != 0 ||
+	    write_loop(ckpt.fd, &h, sizeof(h)) != sizeof(h) || fsync(ckpt.fd))
+		return -1;
+
+/* The messages are still in the order they were parsed in, as are the rests */
+	rests_reset(ckpt.fd, 0, msg_num);
+	ckpt.saved = msg_num;
+
+	return 0;
+}
+
+/* closes the checkpoint file, and removes it if we're done with it */
+static void ckpt_close(int done)
+{
+	if (ckpt.fd >= 0)
+		close(ckpt.fd);
+	ckpt.fd = -1;
+	if (done && ckpt.name)
+		unlink(ckpt.name);
+	free(ckpt.name);
+	ckpt.name = NULL;
+	ckpt.saved = 0;
+}
+
+static void message_header_hash(const char *p, const char *q, idx_hash_t *hash)
+{
+	MD5_CTX ctx;
+	unsigned char hash_full[16];
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, p, q - p);
+	MD5_Final(hash_full, &ctx);
+	memcpy(hash, hash_full, sizeof(*hash));
+}
+
+/*
+ * Message-IDs waiting to be hashed MD5_X4_LANES at a time, along with where
+ * their hashes go: a field of the message being parsed (if num is negative)
+ * or of chunk->msgs[num], 0 for msgid_hash or 1 + the index in irt_hash[],
+ * or nowhere (-1) if another header has replaced this one.  They're grouped
+ * by how many MD5 blocks they take, so that no lane waits for a longer one.
+ */
+struct hash_lanes {
+	int count;
+	idx_msgnum_t num[MD5_X4_LANES];
+	int field[MD5_X4_LANES];
+	unsigned long size[MD5_X4_LANES];
+	char data[MD5_X4_LANES][MD5_X4_MAX_SIZE];
+};
+
+struct hash_batch {
+	struct hash_lanes lanes[MD5_X4_MAX_BLOCKS];
+	unsigned int fields;	/* Those of the message being parsed queued */
+};
+
+static void hash_lanes_flush(struct hash_lanes *lanes,
+    struct mailbox_chunk *chunk, struct parsed_message *msg)
+{
+	const void *data[MD5_X4_LANES];
+	unsigned char result[MD5_X4_LANES][16];
+	idx_hash_t *hash;
+	int i, field;
+
+	if (!lanes->count)
+		return;
+
+	for (i = 0; i < MD5_X4_LANES; i++) {
+		data[i] = lanes->data[i];
+		if (i >= lanes->count)
+			lanes->size[i] = 0;
+	}
+	MD5_x4(result, data, lanes->size);
+
+	for (i = 0; i < lanes->count; i++) {
+		if ((field = lanes->field[i]) < 0)
+			continue;
+		if (lanes->num[i] < 0)
+			hash = field ? &msg->irt_hash[field - 1] :
+			    &msg->msgid_hash;
+		else
+			hash = field ?
+			    &chunk->msgs[lanes->num[i]].irt_hash[field - 1] :
+			    &chunk->msgs[lanes->num[i]].msgid_hash;
+		memcpy(hash, result[i], sizeof(*hash));
+	}
+
+	lanes->count = 0;
+}
+
+static void hash_flush(struct hash_batch *batch, struct mailbox_chunk *chunk,
+    struct parsed_message *msg)
+{
+	int i;
+
+	for (i = 0; i < MD5_X4_MAX_BLOCKS; i++)
+		hash_lanes_flush(&batch->lanes[i], chunk, msg);
+}
+
+/*
+ * Has the Message-ID from p to q hashed into the given field of the message
+ * being parsed, maybe later on.  The rare longer ones are hashed right away.
+ */
+static void hash_queue(struct hash_batch *batch, struct mailbox_chunk *chunk,
+    struct parsed_message *msg, const char *p, const char *q, int field)
+{
+	struct hash_lanes *lanes;
+	int i, j;
+
+/* The last header for a field wins */
+	for (i = 0; i < MD5_X4_MAX_BLOCKS && (batch->fields & (1 << field));
+	    i++) {
+		lanes = &batch->lanes[i];
+		for (j = 0; j < lanes->count; j++)
+			if (lanes->num[j] < 0 && lanes->field[j] == field)
+				lanes->field[j] = -1;
+	}
+
+	if (q - p > MD5_X4_MAX_SIZE) {
+		message_header_hash(p, q, field ? &msg->irt_hash[field - 1] :
+		    &msg->msgid_hash);
+		return;
+	}
+
+	batch->fields |= 1 << field;
+	lanes = &batch->lanes[MD5_X4_BLOCKS(q - p) - 1];
+	i = lanes->count++;
+	lanes->num[i] = -1;
+	lanes->field[i] = field;
+	lanes->size[i] = q - p;
+	memcpy(lanes->data[i], p, q - p);
+	if (lanes->count == MD5_X4_LANES)
+		hash_lanes_flush(lanes, chunk, msg);
+}
+
+/* the message that was being parsed is now chunk->msgs[num] */
+static void hash_bind(struct hash_batch *batch, idx_msgnum_t num)
+{
+	struct hash_lanes *lanes;
+	int i, j;
+
+	for (i = 0; i < MD5_X4_MAX_BLOCKS; i++) {
+		lanes = &batch->lanes[i];
+		for (j = 0; j < lanes->count; j++)
+			if (lanes->num[j] < 0)
+				lanes->num[j] = num;
+	}
+	batch->fields = 0;
+}
+
+/*
+ * The source of mailbox data for the parser.  We map the mailbox in windows
+ * of MAILBOX_MMAP_WINDOW bytes up to the size it had when we started, and
+ * then (or if mmap(2) fails) switch to reading it, like we always did, but
+ * with up to MAILBOX_URING reads in flight on an io_uring if we can.  A
+ * message we've just delivered is taken from memory instead.
+ */
+struct mailbox_reader {
+	int fd;
+	char *buffer;		/* Our read(2) buffer */
+	char *map;		/* Currently mapped window, if any */
+	size_t map_size;
+	off_t offset;		/* Offset of the next data to fetch */
+	off_t map_end;		/* Where to stop mapping */
+	off_t end;		/* Where to stop reading, or -1 for EOF */
+	off_t ahead;		/* How far we've had the kernel read ahead */
+	struct uring *ring;	/* Our reads in flight, if any */
+	char *ring_buffer;	/* MAILBOX_URING blocks to read into */
+	off_t ring_offset;	/* Offset of the oldest read in flight */
+	off_t queued;		/* Offset of the next read to queue */
+	int head, count;	/* Slot of the oldest read in flight, and how many */
+	int ring_failed;	/* Whether to just use pread(2) */
+	const char *prefix;	/* Data to return before the file's */
+	int prefix_size;
+	struct fprinter *fp;	/* What to feed the data to, if anything */
+};
+
+static void reader_init(struct mailbox_reader *reader, int fd, char *buffer,
+    off_t offset, off_t map_end, off_t end)
+{
+	reader->fd = fd;
+	reader->buffer = buffer;
+	reader->map = NULL;
+	reader->map_size = 0;
+	reader->offset = offset;
+	reader->map_end = MAILBOX_MMAP ? map_end : offset;
+	reader->end = end;
+	reader->ahead = offset;
+	reader->ring = NULL;
+	reader->ring_buffer = NULL;
+	reader->ring_offset = reader->queued = offset;
+	reader->head = reader->count = 0;
+	reader->ring_failed = 0;
+	reader->prefix = NULL;
+	reader->prefix_size = 0;
+	reader->fp = NULL;
+
+	if (MAILBOX_READAHEAD)
+		posix_fadvise(fd, offset, end >= 0 ? end - offset : 0,
+		    POSIX_FADV_SEQUENTIAL);
+}
+
+/*
+ * Has the kernel start reading the mailbox up to MAILBOX_READAHEAD past where
+ * we are, so that the data is there by the time we get to it.  We ask for
+ * half of that at a time.
+ */
+static void reader_readahead(struct mailbox_reader *reader)
+{
+	off_t stop;
+
+	stop = reader->offset + MAILBOX_READAHEAD;
+	if (reader->end >= 0 && stop > reader->end)
+		stop = reader->end;
+	if (stop - reader->ahead < MAILBOX_READAHEAD / 2)
+		return;
+
+	posix_fadvise(reader->fd, reader->ahead, stop - reader->ahead,
+	    POSIX_FADV_WILLNEED);
+	reader->ahead = stop;
+}
+
+static void reader_unmap(struct mailbox_reader *reader)
+{
+	if (reader->map) {
+		munmap(reader->map, reader->map_size);
+		reader->map = NULL;
+	}
+}
+
+/* waits for all our reads in flight, discarding the data */
+static void reader_drain(struct mailbox_reader *reader)
+{
+	while (reader->count) {
+		uring_wait(reader->ring, reader->head);
+		if (++reader->head >= MAILBOX_URING)
+			reader->head = 0;
+		reader->count--;
+	}
+}
+
+static void reader_free(struct mailbox_reader *reader)
+{
+	reader_unmap(reader);
+
+	if (reader->ring) {
+		reader_drain(reader);
+		uring_close(reader->ring);
+		reader->ring = NULL;
+	}
+	free(reader->ring_buffer);
+	reader->ring_buffer = NULL;
+}
+
+/*
+ * Reads the next block with io_uring, keeping up to MAILBOX_URING blocks of
+ * FILE_BUFFER_SIZE being read ahead, each into its own part of ring_buffer.
+ * The part we've returned is reused once we're called again.  Returns -2 if
+ * io_uring isn't available, for the caller to use pread(2) instead.
+ */
+static int reader_fetch_uring(struct mailbox_reader *reader, char **data)
+{
+	size_t size;
+	ssize_t block;
+	int slot;
+
+	if (!reader->ring) {
+		if (reader->ring_failed)
+			return -2;
+		reader->ring_buffer = malloc((size_t)MAILBOX_URING *
+		    FILE_BUFFER_SIZE);
+		if (reader->ring_buffer)
+			reader->ring = uring_open(MAILBOX_URING);
+		if (!reader->ring) {
+			free(reader->ring_buffer);
+			reader->ring_buffer = NULL;
+			reader->ring_failed = 1;
+			return -2;
+		}
+	}
+
+/* We may have skipped what we were reading ahead, for a delivered message */
+	if (reader->count && reader->ring_offset != reader->offset)
+		reader_drain(reader);
+	if (!reader->count)
+		reader->ring_offset = reader->queued = reader->offset;
+
+	while (reader->count < MAILBOX_URING &&
+	    (reader->end < 0 || reader->queued < reader->end)) {
+		size = FILE_BUFFER_SIZE;
+		if (reader->end >= 0 && size > reader->end - reader->queued)
+			size = reader->end - reader->queued;
+		slot = reader->head + reader->count;
+		if (slot >= MAILBOX_URING)
+			slot -= MAILBOX_URING;
+		if (uring_read(reader->ring, slot, reader->fd,
+		    &reader->ring_buffer[(size_t)slot * FILE_BUFFER_SIZE],
+		    size, reader->queued))
+			break;
+		reader->queued += size;
+		reader->count++;
+	}
+	if (!reader->count)
+		return 0;
+
+	slot = reader->head;
+	block = uring_wait(reader->ring, slot);
+	if (++reader->head >= MAILBOX_URING)
+		reader->head = 0;
+	reader->count--;
+	reader->ring_offset += FILE_BUFFER_SIZE;
+
+/* After a short read, those that follow aren't where we need them */
+	if (block < FILE_BUFFER_SIZE)
+		reader_drain(reader);
+	if (block > 0) {
+		*data = &reader->ring_buffer[(size_t)slot * FILE_BUFFER_SIZE];
+		reader->offset += block;
+	}
+
+	return block;
+}
+
+static int reader_get(struct mailbox_reader *reader, char **data)
+{
+	off_t start, stop;
+	size_t size;
+	int block;
+
+	reader_unmap(reader);
+
+	if (reader->prefix_size) {
+		*data = (char *)reader->prefix;
+		block = reader->prefix_size;
+		reader->prefix_size = 0;
+		return block;
+	}
+
+	if (delivered.data && reader->offset >= delivered.offset &&
+	    reader->offset < delivered.offset + (off_t)delivered.size) {
+		*data = delivered.data + (reader->offset - delivered.offset);
+		stop = delivered.offset + delivered.size;
+		if (reader->end >= 0 && stop > reader->end)
+			stop = reader->end;
+		if (stop - reader->offset > MAILBOX_MMAP_WINDOW)
+			stop = reader->offset + MAILBOX_MMAP_WINDOW;
+		block = stop - reader->offset;
+		reader->offset += block;
+		return block;
+	}
+
+	if (MAILBOX_READAHEAD)
+		reader_readahead(reader);
+
+	if (reader->offset < reader->map_end) {
+		start = reader->offset -
+		    reader->offset % sysconf(_SC_PAGESIZE);
+		reader->map_size = MAILBOX_MMAP_WINDOW;
+		if (reader->map_size > reader->map_end - start)
+			reader->map_size = reader->map_end - start;
+		reader->map = mmap(NULL, reader->map_size, PROT_READ,
+		    MAP_SHARED, reader->fd, start);
+		if (reader->map != MAP_FAILED) {
+			posix_madvise(reader->map, reader->map_size,
+			    POSIX_MADV_SEQUENTIAL);
+			*data = reader->map + (reader->offset - start);
+			block = reader->map_size - (reader->offset - start);
+			reader->offset += block;
+			return block;
+		}
+		reader->map = NULL;
+		reader->map_end = reader->offset;
+	}
+
+	if (MAILBOX_URING && (block = reader_fetch_uring(reader, data)) != -2)
+		return block;
+
+	size = FILE_BUFFER_SIZE;
+	if (reader->end >= 0 && size > reader->end - reader->offset)
+		size = reader->end - reader->offset;
+	*data = reader->buffer;
+	block = pread(reader->fd, reader->buffer, size, reader->offset);
+	if (block > 0)
+		reader->offset += block;
+	return block;
+}
+
+/* points *data to the next block of the mailbox and returns its size */
+static int reader_fetch(struct mailbox_reader *reader, char **data)
+{
+	int block;
+
+	block = reader_get(reader, data);
+	if (block > 0 && reader->fp)
+		fprint_feed(reader->fp, reader->offset - block, *data, block);
+
+	return block;
+}
+
+/* whether the header line is one of those we use */
+static int header_wanted(const char *p, size_t l)
+{
+	switch (*p) {
+	case 'M':
+	case 'm':
+		return eq(p, l, "Message-ID:", 11);
+	case 'I':
+	case 'i':
+		return eq(p, l, "In-Reply-To:", 12);
+	case 'R':
+	case 'r':
+		return eq(p, l, "References:", 11);
+	case 'F':
+	case 'f':
+		return eq(p, l, "From:", 5);
+	case 'S':
+	case 's':
+		return eq(p, l, "Subject:", 8);
+	}
+
+	return 0;
+}
+
+/*
+ * Appends the header lines in p, of length chars (starting at the start of a
+ * line if start is set), to dst, but only the headers we use, including their
+ * continuation lines.  *keep says whether we're in one of those.
+ */
+static void headers_append(struct buffer *dst, const char *p, size_t length,
+    int start, int *keep)
+{
+	const char *q, *end = p + length;
+
+	for (; p < end; p = q, start = 1) {
+		if (start && *p != ' ' && *p != '\t')
+			*keep = header_wanted(p, end - p);
+		q = memchr(p, '\n', end - p);
+		q = q ? q + 1 : end;
+		if (*keep)
+			buffer_append(dst, p, q - p);
+	}
+}
+
+/*
+ * The mailbox parsing routine.
+ * We implement a state machine at the line fragment level (that is, full or
+ * partial lines).  This is faster than dealing with individual characters
+ * (we leave that job for libc) and it doesn't require ever loading entire
+ * lines into memory.
+ */
+static int mailbox_parse_chunk(struct mailbox_chunk *chunk)
+{
+	struct mailbox_reader reader;		/* Source of the data */
+	struct parsed_message msg;		/* Message being parsed */
+	struct hash_batch batch;		/* Its IDs, and previous ones' */
+	struct buffer premime;			/* Buffered raw headers */
+	struct buffer headers;			/* Those to decode, wherever */
+	struct mime_ctx mime;			/* MIME decoding context */
+	char *file_buffer, *line_buffer;	/* Our internal buffers */
+	off_t file_offset, line_offset;		/* Their offsets in the file */
+	off_t offset;				/* A line fragment's offset */
+	char *current, *next, *line;		/* Line pointers */
+	char *hdr_start, *hdr_end;		/* Headers we haven't copied */
+	int block, saved, extra, length;	/* Internal block sizes */
+	int done, start, end;			/* Various boolean flags: */
+	int blank, header, body, keep;		/* the state information */
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&batch, 0, sizeof(batch));
+
+	file_buffer = malloc(FILE_BUFFER_SIZE + LINE_BUFFER_SIZE);
+	if (!file_buffer)
+		return chunk->error = 1;
+	line_buffer = &file_buffer[FILE_BUFFER_SIZE];
+
+	if (buffer_init(&premime, 0)) {
+		free(file_buffer);
+		return chunk->error = 1;
+	}
+	memcpy(&headers, &premime, sizeof(headers));
+	if (mime_init(&mime, &headers)) {
+		buffer_free(&premime);
+		free(file_buffer);
+		return chunk->error = 1;
+	}
+
+/* A folder's files are mostly small enough that mapping them costs more */
+	reader_init(&reader, chunk->fd, file_buffer, chunk->start,
+	    chunk->prefix_size ? chunk->start : chunk->end,
+	    chunk->to_eof ? -1 : chunk->end);
+	reader.prefix = chunk->prefix;
+	reader.prefix_size = chunk->prefix_size;
+	if (chunk->fd == fprints.fd)
+		reader.fp = &chunk->fp;
+	file_offset = line_offset = offset = chunk->start; /* Start there, */
+	current = file_buffer; block = 0; saved = 0;	/* and empty buffers */
+
+	done = 0;	/* Haven't reached EOF or the original size yet */
+	end = 1;	/* Assume we've just seen a LF: parse a new line */
+	blank = 1;	/* Assume we've seen a blank line: look for "From " */
+	header = 0;	/* Not in message headers, */
+	body = 0;	/* and not in message body */
+	hdr_start = hdr_end = NULL; keep = 0;
+
+/*
+ * The main loop.  Its first part extracts the line fragments, while the
+ * second one manages the state flags and performs whatever is required
+ * based on the state.  Unfortunately, splitting this into two functions
+ * didn't seem to simplify the code.
+ */
+	do {
+/*
+ * Part 1.
+ * The line fragment extraction.
+ */
+
+/*
+ * In a message body, we're only interested in a blank line followed by
+ * "From ".  Rather than go through the state machine for every line, skip
+ * to the next such blank line, or to the last complete line in the buffer.
+ * We look for the 'F' with memchr(), which is vectorized in libc; capital
+ * 'F' is a lot less common in message bodies than LF is.
+ */
+		if (!header && end && !saved && !blank && block > 0) {
+			char *p = current, *q, *skip = NULL;
+			int i;
+
+			while ((q = memchr(p, 'F', current + block - p))) {
+				if (q > current && q[-1] == '\n' &&
+				    (q - 1 == current || q[-2] == '\n')) {
+					if (current + block - q < 5)
+						break;
+					if (!memcmp(q, "From ", 5)) {
+						skip = q - 1;
+						break;
+					}
+				}
+				p = q + 1;
+			}
+			if (!skip) {
+				i = block;
+				while (i > 0 && current[i - 1] != '\n')
+					i--;
+				if (i > 0)
+					i--;
+				while (i > 0 && current[i - 1] != '\n')
+					i--;
+				skip = current + i;
+			}
+			if (skip > current) {
+				if (msg.data_offset)
+					body = 1;
+				block -= skip - current;
+				current = skip;
+			}
+		}
+
+/* Look for the next LF in the file buffer */
+		if ((next = memchr(current, '\n', block))) {
+/* Found it: get the length of this piece, and check for buffered data */
+			length = ++next - current;
+			if (saved) {
+/* Have this line's beginning in the line buffer: combine them */
+				extra = LINE_BUFFER_SIZE - saved;
+				if (extra > length)
+					extra = length;
+				memcpy(&line_buffer[saved], current, extra);
+				current += extra; block -= extra;
+				length = saved + extra;
+				line = line_buffer;
+				offset = line_offset;
+				start = end; end = current == next;
+				saved = 0;
+			} else {
+/* Nothing in the line buffer: just process what we've got now */
+				line = current;
+				offset = file_offset - block;
+				start = end; end = 1;
+				current = next; block -= length;
+			}
+		} else {
+/* No more LFs in the file buffer */
+			if (saved || block <= LINE_BUFFER_SIZE) {
+/* Have this line's beginning in the line buffer: combine them */
+/* Not enough data to process right now: buffer it */
+				extra = LINE_BUFFER_SIZE - saved;
+				if (extra > block)
+					extra = block;
+				if (!saved)
+					line_offset = file_offset - block;
+				memcpy(&line_buffer[saved], current, extra);
+				current += extra; block -= extra;
+				saved += extra;
+				length = saved;
+				line = line_buffer;
+				offset = line_offset;
+			} else {
+/* Nothing in the line buffer and we've got enough data: just process it */
+				length = block - 1;
+				line = current;
+				offset = file_offset - block;
+				current += length;
+				block = 1;
+			}
+			if (!block) {
+/* We've emptied the file buffer: copy the headers we'll still need from it */
+				if (hdr_start) {
+					headers_append(&premime, hdr_start,
+					    hdr_end - hdr_start, 1, &keep);
+					hdr_start = NULL;
+				}
+/* Then fetch some more data */
+				block = reader_fetch(&reader, &current);
+				if (block < 0)
+					break;
+				file_offset += block;
 				if (block > 0 && saved < LINE_BUFFER_SIZE)
 					continue;
 				if (!saved) {
@@ -536,26 +2590,31 @@ static int mailbox_parse_fd(int fd)
  */
 
 /* Check for a new message if we've just seen a blank line */
-		if (blank && start)
+/* (but a file of a folder has just the one, after our "From " line) */
+		if (blank && start &&
+		    (!chunk->prefix_size || offset == chunk->start))
 		if (line[0] == 'F' && length >= 5 &&
 		    line[1] == 'r' && line[2] == 'o' && line[3] == 'm' &&
 		    line[4] == ' ') {
 /* Process the previous one first, if exists */
-			if (offset > inc_ofs) {
+			if (offset > chunk->start) {
 /* If we aren't at the very beginning, there must have been a message */
 				if (!msg.data_offset)
 					break;
 				msg.raw_size = offset - msg.raw_offset;
 				msg.data_size = offset - body - msg.data_offset;
-				log_percentage(offset, stat.st_size);
-				if (message_process(&msg))
+				if (chunk->report)
+					log_percentage(offset, chunk->end);
+				if (message_process(chunk, &msg))
 					break;
+				hash_bind(&batch, chunk->msg_num - 1);
 			}
 			msg.tm.tm_year = 0;
 			if (line[length - 1] == '\n') {
 				const char *p = memchr(line + 5, ' ', length - 5);
 				if (p) {
-					p = strptime(p, " %a %b %d %T %Y", &msg.tm);
+					p = from_date(p, line + length - p,
+					    &msg.tm);
 					if (!p || *p != '\n')
 						msg.tm.tm_year = 0;
 				}
@@ -565,10 +2624,12 @@ static int mailbox_parse_fd(int fd)
 			msg.data_offset = 0;
 			msg.have_msgid = 0;
 			msg.have_irt = 0;
+			memset(msg.irt_hash, 0, sizeof(msg.irt_hash));
 			msg.from = NULL;
 			msg.subject = NULL;
 			premime.ptr = premime.start;
 			mime.dst.ptr = mime.dst.start;
+			hdr_start = NULL; keep = 0;
 			header = 1; body = 0;
 			continue;
 		}
@@ -577,6 +2638,9 @@ static int mailbox_parse_fd(int fd)
 		if (header && start && !msg.data_offset) {
 			msg.data_offset = offset;
 			msg.data_size = 0;
+/* Leave the headers where they are for as long as they're in file_buffer */
+			if (line != line_buffer)
+				hdr_start = hdr_end = line;
 		}
 
 /* If we see LF at start of line, then this is a blank line :-) */
@@ -591,8 +2655,19 @@ static int mailbox_parse_fd(int fd)
 			continue;
 		}
 
-/* Buffer the headers and the blank line for MIME decoding */
-		buffer_append(&premime, line, length);
+/*
+ * Buffer the headers we use for MIME decoding, unless we can decode them from
+ * file_buffer (or the mapping) once we've got them all
+ */
+		if (hdr_start && line != hdr_end) {
+			headers_append(&premime, hdr_start, hdr_end - hdr_start,
+			    1, &keep);
+			hdr_start = NULL;
+		}
+		if (hdr_start)
+			hdr_end += length;
+		else
+			headers_append(&premime, line, length, start, &keep);
 
 /* Blank line ends message headers */
 		if (!blank)
@@ -600,10 +2675,19 @@ static int mailbox_parse_fd(int fd)
 		header = 0;
 
 /* Now decode MIME */
-		premime.ptr = premime.start;
-		while (premime.ptr < premime.end && *premime.ptr != '\n') {
-			char *p = premime.ptr;
-			size_t l = premime.end - p, m = 0;
+		if (hdr_start) {
+			headers.start = hdr_start;
+			headers.end = hdr_end;
+		} else {
+			headers.start = premime.start;
+			headers.end = premime.ptr;
+		}
+		headers.ptr = headers.start;
+		headers.error = 0;
+		hdr_start = NULL;
+		while (headers.ptr < headers.end && *headers.ptr != '\n') {
+			char *p = headers.ptr;
+			size_t l = headers.end - p, m = 0;
 			switch (*p) {
 			case 'M':
 			case 'm':
@@ -625,10 +2709,10 @@ static int mailbox_parse_fd(int fd)
 					if (!*q || q - p < 4)
 						continue;
 					if (m) {
-						message_header_hash(p, q, &msg.msgid_hash);
+						hash_queue(&batch, chunk, &msg, p, q, 0);
 						msg.have_msgid = 1;
 					} else {
-						message_header_hash(p, q, &msg.irt_hash[1]);
+						hash_queue(&batch, chunk, &msg, p, q, 2);
 						msg.have_irt |= 1 << 1;
 					}
 					continue;
@@ -661,7 +2745,8 @@ static int mailbox_parse_fd(int fd)
 							q++;
 						if (!*q || q - p < 4)
 							continue;
-						message_header_hash(p, q, &msg.irt_hash[hi]);
+						hash_queue(&batch, chunk, &msg, p, q,
+						    hi + 1);
 						msg.have_irt |= 1 << hi;
 					}
 					continue;
@@ -703,39 +2788,482 @@ static int mailbox_parse_fd(int fd)
 		}
 	} while (1);
 
-	if (premime.error)
-		done = 0;
-	buffer_free(&premime);
-	free(file_buffer);
+	if (premime.error)
+		done = 0;
+	buffer_free(&premime);
+	reader_free(&reader);
+	free(file_buffer);
+
+	if (offset != chunk->end + chunk->prefix_size || !msg.data_offset)
+		done = 0;
+
+	if (done) {
+/* Process the last message */
+		msg.raw_size = offset - msg.raw_offset;
+		msg.data_size = offset - (blank & body) - msg.data_offset;
+		if (message_process(chunk, &msg))
+			done = 0;
+		else
+			hash_bind(&batch, chunk->msg_num - 1);
+	}
+	hash_flush(&batch, chunk, &msg);
+
+	if (mime.dst.error)
+		done = 0;
+	mime_free(&mime);
+
+	chunk->offset = offset;
+	return chunk->error = !done;
+}
+
+static void *mailbox_parse_thread(void *arg)
+{
+	mailbox_parse_chunk(arg);
+	return NULL;
+}
+
+/*
+ * Returns the offset of the first "From " line preceded by a blank line
+ * that is past offset, or -1 if there's none before end.
+ */
+static off_t mailbox_find_boundary(int fd, char *buffer, off_t offset,
+    off_t end)
+{
+	char *p, *q;
+	ssize_t block;
+	size_t size;
+
+	while (end - offset >= 7) {
+		size = FILE_BUFFER_SIZE;
+		if (size > end - offset)
+			size = end - offset;
+		block = pread(fd, buffer, size, offset);
+		if (block < 7)
+			break;
+		p = buffer;
+		while ((q = memchr(p, '\n', buffer + block - 6 - p))) {
+			if (!memcmp(q + 1, "\nFrom ", 6))
+				return offset + (q - buffer) + 2;
+			p = q + 1;
+		}
+		offset += block - 6;
+	}
+
+	return -1;
+}
+
+/*
+ * Parses the mailbox from *offset (which must be the start of a message)
+ * until EOF, or only until the first message boundary past stop if that's
+ * non-negative, appending the messages to msgs[], and advances *offset.  The
+ * data is split into up to mailbox_threads chunks at message boundaries,
+ * which are parsed in parallel and then merged in order.  The messages'
+ * rests go to spill files for the mailbox named by spill, unless it's NULL.
+ * *data_end is raised to past the end of the last message's data, plus 1,
+ * if it's beyond.  The messages' offsets in the index are base plus those in
+ * the file.
+ */
+static int mailbox_parse_fd(int fd, off_t *offset, off_t stop,
+    off_t *data_end, const char *spill, off_t base)
+{
+	struct stat stat;
+	struct mailbox_chunk *chunks, *chunk;
+	char *buffer;
+	off_t unindexed_size, from, boundary, avg, end;
+	int i, n, error;
+
+	if (fstat(fd, &stat))
+		return 1;
+	unindexed_size = stat.st_size - *offset;
+	if (!unindexed_size)
+		return 0;
+	if (unindexed_size < 0 || !S_ISREG(stat.st_mode) ||
+	    stat.st_size > MAX_MAILBOX_BYTES || (stat.st_size >> (sizeof(off_t) * 8 - 1)))
+		return 1;
+
+	n = mailbox_threads;
+	if (n < 1)
+		n = 1;
+	chunks = calloc(n, sizeof(*chunks));
+	buffer = malloc(FILE_BUFFER_SIZE);
+	if (!chunks || !buffer) {
+		free(buffer);
+		free(chunks);
+		return 1;
+	}
+
+	end = stat.st_size;
+	if (stop >= *offset && stop < end &&
+	    (boundary = mailbox_find_boundary(fd, buffer, stop, end)) >= 0) {
+		end = boundary;
+		unindexed_size = end - *offset;
+	}
+
+/* Expect the new messages to be of the same average size as the old ones */
+	avg = MSG_SIZE_GUESS;
+	if (!base && msg_num > 0 && *offset / msg_num > 0)
+		avg = *offset / msg_num;
+
+/* The first chunk continues msgs[], the rest start with empty arrays */
+	for (i = 0; i < n; i++)
+		chunks[i].base = base;
+	chunk = &chunks[0];
+	chunk->start = *offset;
+	chunk->msgs = msgs;
+	chunk->msg_num = msg_num;
+	chunk->msg_alloc = msg_alloc;
+	msgs = NULL;
+	msg_num = msg_alloc = 0;
+	for (i = 1; i < n; i++, chunk++) {
+		from = *offset + unindexed_size / n * i;
+		if (from < chunk->start)
+			from = chunk->start;
+		boundary = mailbox_find_boundary(fd, buffer, from, end);
+		if (boundary < 0)
+			break;
+		chunk->end = boundary;
+		chunk[1].start = boundary;
+	}
+	free(buffer);
+	n = i;
+	chunk->end = end;
+	chunk->to_eof = end == stat.st_size;
+
+	if (n > 1)
+		logtty("Parsing in %d chunks\n", n);
+	for (i = 0, chunk = chunks; i < n; i++, chunk++) {
+		chunk->msg_first = chunk->msg_num;
+		chunk->seg.fd = -1;
+/* The first chunk picks up where we've got with the fingerprints */
+		chunk->fp.lanes.offset = -1;
+		if (!i)
+			memcpy(&chunk->fp.lanes, &fprints.fp.lanes,
+			    sizeof(chunk->fp.lanes));
+		if (spill && (chunk->seg.fd = spill_open(spill)) < 0)
+			fprintf(stderr, "Warning: failed to create a spill "
+			    "file, keeping the messages in memory\n");
+/* The first chunk's array will also receive the other chunks' messages */
+		msgs_presize(chunk, (i ? chunk->end : end) -
+		    chunk->start, avg);
+		chunk->fd = fd;
+		chunk->report = !i;
+		if (!i)
+			continue;
+		chunk->threaded = !pthread_create(&chunk->thread, NULL,
+		    mailbox_parse_thread, chunk);
+		if (!chunk->threaded)
+			mailbox_parse_chunk(chunk);
+	}
+	mailbox_parse_chunk(&chunks[0]);
+
+	error = 0;
+	for (i = 0, chunk = chunks; i < n; i++, chunk++) {
+		if (chunk->threaded)
+			pthread_join(chunk->thread, NULL);
+		error |= chunk->error || msgs_append(chunk);
+		free(chunk->msgs);
+		seg_free(&chunk->seg);
+		if (fd == fprints.fd)
+			fprints_append(chunk);
+		if (*data_end < chunk->data_end)
+			*data_end = chunk->data_end;
+	}
+	*offset = chunks[n - 1].offset;
+
+	free(chunks);
+
+	return error;
+}
+
+/*
+ * Parses the mailbox like mailbox_parse_fd() does, but CHECKPOINT_BYTES at a
+ * time, saving the messages parsed so far to the checkpoint file in between.
+ * If next isn't negative, also saves them at the end, with that offset to
+ * resume at.
+ */
+static int mailbox_parse_slices(int fd, off_t *offset, off_t *data_end,
+    const char *spill, off_t base, off_t next)
+{
+	struct stat st;
+	off_t at;
+
+	for (;;) {
+		if (mailbox_parse_fd(fd, offset, *offset + CHECKPOINT_BYTES,
+		    data_end, spill, base) || fstat(fd, &st))
+			return 1;
+		at = base + *offset;
+		if (*offset >= st.st_size && (at = next) < 0)
+			return 0;
+		logtty("Saving checkpoint at %llu\n", (unsigned long long)at);
+		if (ckpt_save(at))
+			break;
+		if (at == next)
+			return 0;
+	}
+
+	fprintf(stderr, "Warning: failed to save a checkpoint, "
+	    "proceeding without\n");
+
+	return mailbox_parse_fd(fd, offset, -1, data_end, spill, base);
+}
+
+/*
+ * Has a compressed segment decompressed into a temporary file next to the
+ * mailbox, which is removed right away, and closes fd.  Returns the file to
+ * parse, which is fd itself if the segment isn't compressed, or -1 on error.
+ */
+static int segment_plain(int fd)
+{
+	int plain_fd;
+
+	switch (zfile_compressed(fd)) {
+	case 0:
+		return fd;
+	case 1:
+		logtty("Decompressing segment...\n");
+		if ((plain_fd = spill_open(segments.path)) >= 0 &&
+		    zfile_decompress(fd, plain_fd)) {
+			close(plain_fd);
+			plain_fd = -1;
+		}
+		break;
+	default:
+		plain_fd = -1;
+	}
+	if (plain_fd < 0)
+		fprintf(stderr, "Failed to decompress the segment\n");
+	close(fd);
+
+	return plain_fd;
+}
+
+/*
+ * Parses the older segments of the mailbox, from the one *offset is in on,
+ * and sets *offset to the start of the active segment.
+ */
+static int segments_parse(off_t *offset, off_t *data_end, const char *spill)
+{
+	off_t file, pos;
+	int fd, error;
+
+	for (file = IDX_FILE(*offset); file < segments.count; file++) {
+		if ((fd = segment_open(file)) < 0 ||
+		    (fd = segment_plain(fd)) < 0)
+			return 1;
+		pos = IDX_FILE_OFFSET(*offset);
+		logtty("Parsing segment %s from %llu...\n",
+		    folder_name(&segments, file), (unsigned long long)pos);
+		error = mailbox_parse_slices(fd, &pos, data_end, spill,
+		    file << IDX_FILE_SHIFT, (file + 1) << IDX_FILE_SHIFT);
+		close(fd);
+		if (error)
+			return 1;
+		*offset = (file + 1) << IDX_FILE_SHIFT;
+	}
+
+	return 0;
+}
+
+/*
+ * Parses a range of the folder's files into the chunk, one at a time, each
+ * after a "From " line with the time the file was last modified.
+ */
+static int folder_parse_chunk(struct mailbox_chunk *chunk)
+{
+	char from[64];
+	struct stat st;
+	struct tm tm;
+	const char *name;
+	off_t file;
+
+	chunk->prefix = from;
+	for (file = chunk->file; file < chunk->last; file++) {
+		if (!(name = folder_name(&folder, file)))
+			continue;
+/* It may have been removed since we've looked, which we'll see next time */
+		if ((chunk->fd = folder_open_file(folder.path, name)) < 0) {
+			if (errno == ENOENT)
+				continue;
+			return chunk->error = 1;
+		}
+		if (fstat(chunk->fd, &st)) {
+			close(chunk->fd);
+			return chunk->error = 1;
+		}
+		if (!S_ISREG(st.st_mode) || !st.st_size ||
+		    st.st_size > MAX_MAILBOX_BYTES) {
+			close(chunk->fd);
+			continue;
+		}
+
+		localtime_r(&st.st_mtime, &tm);
+		chunk->prefix_size = strftime(from, sizeof(from),
+		    "From MAILER-DAEMON %a %b %e %H:%M:%S %Y\n", &tm);
+		chunk->start = 0;
+		chunk->end = st.st_size;
+		chunk->base = (file << IDX_FILE_SHIFT) - chunk->prefix_size;
+		mailbox_parse_chunk(chunk);
+		close(chunk->fd);
+		if (chunk->error)
+			break;
+	}
+	chunk->prefix = NULL;
+	chunk->prefix_size = 0;
 
-	if (offset != stat.st_size || !msg.data_offset)
-		done = 0;
+	return chunk->error;
+}
 
-	if (done) {
-/* Process the last message */
-		msg.raw_size = offset - msg.raw_offset;
-		msg.data_size = offset - (blank & body) - msg.data_offset;
-		if (message_process(&msg))
-			done = 0;
+static void *folder_parse_thread(void *arg)
+{
+	folder_parse_chunk(arg);
+	return NULL;
+}
+
+/*
+ * Parses the folder's files from number *offset on, appending the messages
+ * to msgs[] in the order of the files, and advances *offset past the last
+ * one.  The files are split into up to mailbox_threads ranges, which are
+ * parsed in parallel and merged like the chunks of an mbox are.
+ */
+static int folder_parse(off_t *offset, const char *spill)
+{
+	struct mailbox_chunk *chunks, *chunk;
+	off_t count;
+	int i, n, error;
+
+	count = folder.count - *offset;
+	if (count <= 0)
+		return count < 0;
+
+	n = mailbox_threads;
+	if (n < 1)
+		n = 1;
+	if (n > count)
+		n = count;
+	chunks = calloc(n, sizeof(*chunks));
+	if (!chunks)
+		return 1;
+
+	chunk = &chunks[0];
+	chunk->msgs = msgs;
+	chunk->msg_num = msg_num;
+	chunk->msg_alloc = msg_alloc;
+	msgs = NULL;
+	msg_num = msg_alloc = 0;
+
+	if (n > 1)
+		logtty("Parsing in %d chunks\n", n);
+	for (i = 0, chunk = chunks; i < n; i++, chunk++) {
+		chunk->file = *offset + count * i / n;
+		chunk->last = *offset + count * (i + 1) / n;
+		chunk->msg_first = chunk->msg_num;
+		chunk->seg.fd = -1;
+		if (spill && (chunk->seg.fd = spill_open(spill)) < 0)
+			fprintf(stderr, "Warning: failed to create a spill "
+			    "file, keeping the messages in memory\n");
+/* The first chunk's array will also receive the other chunks' messages */
+		msgs_presize(chunk, (i ? chunk->last : folder.count) -
+		    chunk->file, 1);
+		if (!i)
+			continue;
+		chunk->threaded = !pthread_create(&chunk->thread, NULL,
+		    folder_parse_thread, chunk);
+		if (!chunk->threaded)
+			folder_parse_chunk(chunk);
+	}
+	folder_parse_chunk(&chunks[0]);
+
+	error = 0;
+	for (i = 0, chunk = chunks; i < n; i++, chunk++) {
+		if (chunk->threaded)
+			pthread_join(chunk->thread, NULL);
+		error |= chunk->error || msgs_append(chunk);
+		free(chunk->msgs);
+		seg_free(&chunk->seg);
 	}
+	*offset = folder.count;
 
-	if (mime.dst.error)
-		done = 0;
-	mime_free(&mime);
+	free(chunks);
 
-	return !done;
+	return error;
 }
 
-int mailbox_parse(const char *mailbox)
+/* forgets the index we've kept in memory, if any */
+static void resident_drop(void)
+{
+	free(resident.mailbox);
+	resident.mailbox = NULL;
+	free(msgs);
+	msgs = NULL;
+	msg_num = msg_alloc = 0;
+}
+
+/*
+ * Returns the offset to resume indexing the mailbox at if we've kept its
+ * index in memory and the index file is still the way we left it, or 0 if
+ * we need to read the index from the file.
+ */
+static off_t resident_resume(const char *mailbox, int idx_fd, int fd,
+    off_t idx_offset)
+{
+	struct stat st;
+	off_t size;
+
+	if (!resident.mailbox)
+		return 0;
+
+	if (strcmp(resident.mailbox, mailbox) || fstat(idx_fd, &st) ||
+	    st.st_dev != resident.idx_dev || st.st_ino != resident.idx_ino ||
+	    st.st_size != resident.idx_size ||
+	    st.st_mtime != resident.idx_mtime ||
+	    idx_offset != resident.idx_offset ||
+	    (size = lseek(fd, 0, SEEK_END)) < 0 ||
+	    active_base() + size < resident.offset) {
+		resident_drop();
+		return 0;
+	}
+
+	rests_reset(idx_fd, 1, msg_num);
+
+	return resident.offset;
+}
+
+static void resident_keep(const char *mailbox, int idx_fd, off_t offset,
+    off_t idx_offset)
+{
+	struct stat st;
+
+	free(resident.mailbox);
+	if (fstat(idx_fd, &st) || !(resident.mailbox = strdup(mailbox))) {
+		resident.mailbox = NULL;
+		resident_drop();
+		return;
+	}
+
+	resident.offset = offset;
+	resident.idx_offset = idx_offset;
+	resident.idx_dev = st.st_dev;
+	resident.idx_ino = st.st_ino;
+	resident.idx_size = st.st_size;
+	resident.idx_mtime = st.st_mtime;
+}
+
+/*
+ * Updates the index of the mailbox, and sets *offset to how much of the
+ * mailbox it covers.  Returns a non-zero value on error.
+ */
+static int mailbox_update(const char *mailbox, off_t *offset)
 {
 	const char *p;
-	int fd, idx_fd;
-	char *idx;
-	off_t idx_size;
-	size_t msgs_size;
-	int error;
-	idx_msgnum_t old_msg_num;
-	off_t inc_ofs = 0;
+	struct stat st;
+	int fd, idx_fd, new_fd;
+	char *idx, *new_idx;
+	off_t idx_size = -1;
+	int error, sorted = 0, full = 0, relink = 0;
+	idx_msgnum_t i, old_msg_num;
+	idx_msgnum_t *old_by_aday;
+	char *old_links;
+	off_t inc_ofs = 0, idx_ofs = -1, resident_ofs = 0, parse_ofs, pos;
 
 	if ((p = strrchr(mailbox, '/')))
 		list = p + 1;
@@ -746,11 +3274,33 @@ int mailbox_parse(const char *mailbox)
 	if (fd < 0)
 		return 1;
 
+	/* a directory is a Maildir or MH folder: see what files it has now;
+	 * an mbox may have older segments, unless it's rotated only halfway */
+	if (fstat(fd, &st) || (S_ISDIR(st.st_mode) ?
+	    folder_open(&folder, mailbox) :
+	    folder_segments(&segments, mailbox))) {
+		close(fd);
+		return 1;
+	}
+	if (segment_is_active(fd)) {
+		fprintf(stderr, "The mailbox has been rotated only halfway, "
+		    "rotate it again to complete\n");
+		folder_close(&segments, 0);
+		close(fd);
+		return 1;
+	}
+
 	error = lock_fd(fd, 1);
 
 	idx_fd = -1;
 	idx = concat(mailbox, INDEX_FILENAME_SUFFIX, NULL);
-	if (!idx) {
+	fprints.name = concat(mailbox, FPRINTS_FILENAME_SUFFIX, NULL);
+	fprints.keep = UINT_MAX;
+	if (!idx || !fprints.name) {
+		folder_close(&folder, 0);
+		folder_close(&segments, 0);
+		free(fprints.name);
+		free(idx);
 		close(fd);
 		return 1;
 	}
@@ -763,50 +3313,125 @@ int mailbox_parse(const char *mailbox)
 			logtty("Incompatible index (needs rebuild)\n");
 			error = 1;
 		}
+		idx_ofs = inc_ofs;
 
 		if (!error) {
-			struct stat st;
-
-			/* if mbox is unmodified, exit w/o error */
-			if (!fstat(fd, &st) && inc_ofs == st.st_size) {
+			/* if mbox is unmodified, exit w/o error (for a folder,
+			 * that's if it has no new files, and none are gone) */
+			if (folder.path ? inc_ofs == folder.count &&
+			    !folder.missing && !folder_save(&folder) :
+			    !fstat(fd, &st) &&
+			    inc_ofs == active_base() + st.st_size) {
 				logtty("mbox is unmodified (%llu)\n", (unsigned long long)inc_ofs);
 				unlock_fd(idx_fd);
 				close(idx_fd);
 				unlock_fd(fd);
 				close(fd);
+				*offset = inc_ofs - active_base();
+				folder_close(&folder, 0);
+				folder_close(&segments, 0);
+				free(fprints.name);
 				free(idx);
 				return 0;
 			}
 
 			logtty("Resuming index file\n");
-			inc_ofs = begin_inc_idx(idx_fd, fd);
+			inc_ofs = resident_resume(mailbox, idx_fd, fd, idx_ofs);
+			if (!inc_ofs)
+				inc_ofs = begin_inc_idx(idx_fd, fd, &relink);
+			/* a folder's index covers its files up to the number in
+			 * the header, unless some of those are gone */
+			if (folder.path && inc_ofs > 0) {
+				inc_ofs = idx_ofs <= folder.count ? idx_ofs : 0;
+				if (folder.missing) {
+					fprintf(stderr, "Warning: files removed "
+					    "from the folder, performing full "
+					    "indexing\n");
+					inc_ofs = 0;
+				}
+			}
+			/* after a rotation, pick up at the new active segment */
+			if (!folder.path && inc_ofs > 0 &&
+			    inc_ofs < active_base())
+				inc_ofs = active_base();
 			error = inc_ofs < 0;
 		}
 		error |= unlock_fd(idx_fd);
 	}
 
-	/* otherwise create new index */
-	if (!error && idx_fd < 0)
-		idx_fd = open(idx, O_CREAT | O_WRONLY, 0644);
-	free(idx);
-
-	error |= idx_fd < 0;
-
+	/* otherwise index the mailbox from scratch, maybe from a checkpoint */
 	if (inc_ofs <= 0) {
+		resident_drop();
+		rests_reset(-1, 0, 0);
 		inc_ofs = 0;
 		msg_num = 0;
 		msg_alloc = 0;
 		msgs = NULL;
+		full = 1;
+		relink = 0;
+		fprints.keep = 0;
+		if (!folder.path) {
+			ckpt.name = concat(mailbox, CHECKPOINT_FILENAME_SUFFIX,
+			    NULL);
+			error |= !ckpt.name;
+		}
+	}
+	old_msg_num = relink ? 0 : msg_num;
+
+	/* remember what's in the existing index, so that we can only update
+	 * what changes (unless we have to re-sort the messages) */
+	old_by_aday = NULL;
+	old_links = NULL;
+	if (old_msg_num > 0) {
+		old_by_aday = malloc(sizeof(num_by_aday));
+		old_links = malloc((size_t)old_msg_num * sizeof(msgs->t));
+		if (old_by_aday && old_links) {
+			memcpy(old_by_aday, num_by_aday, sizeof(num_by_aday));
+			for (i = 0; i < old_msg_num; i++)
+				memcpy(&old_links[i * sizeof(msgs->t)],
+				    &msgs[i].t, sizeof(msgs->t));
+		} else {
+			free(old_by_aday);
+			free(old_links);
+			old_by_aday = NULL;
+			old_links = NULL;
+		}
 	}
-	old_msg_num = msg_num;
+
+	/* map the Message-ID and thread tables kept from the last run */
 	if (!error)
-		error = lseek(fd, inc_ofs, SEEK_SET) != inc_ofs;
+		links_open(relink ? -1 : idx_ofs);
 
-	/* load messages into idx_message msgs[] */
+	/* load messages into mem_message msgs[] */
 	if (!error) {
+		resident_ofs = inc_ofs;
+		if (full && !folder.path)
+			inc_ofs = ckpt_resume(fd, &resident_ofs);
 		logtty("Parsing mailbox from %llu...\n", (unsigned long long)inc_ofs);
-		error = mailbox_parse_fd(fd);
-		inc_ofs = lseek(fd, 0, SEEK_CUR);
+		parse_ofs = inc_ofs;
+		if (folder.path) {
+			error = folder_parse(&inc_ofs, mailbox) ||
+			    folder_save(&folder);
+		} else {
+			fprints_resume(fd, parse_ofs - active_base());
+			if (inc_ofs < active_base())
+				error = segments_parse(&inc_ofs, &resident_ofs,
+				    mailbox);
+			pos = inc_ofs - active_base();
+			if (!error && full)
+				error = mailbox_parse_slices(fd, &pos,
+				    &resident_ofs, mailbox, active_base(), -1);
+			else if (!error)
+				error = mailbox_parse_fd(fd, &pos, -1,
+				    &resident_ofs, mailbox, active_base());
+			inc_ofs = active_base() + pos;
+		}
+		if (!error && !folder.path && (fprints.keep != UINT_MAX ||
+		    parse_ofs != inc_ofs) &&
+		    fprints_update(fd, inc_ofs - active_base()))
+			fprintf(stderr, "Warning: failed to update the mailbox "
+			    "fingerprints\n");
+		fprints.fd = -1;
 		error |= unlock_fd(fd);
 	}
 
@@ -815,52 +3440,594 @@ int mailbox_parse(const char *mailbox)
 	/* update index map and rebuild thread links */
 	if (!error) {
 		logtty("Linking threads...\n");
-		error = msgs_final(old_msg_num) < 0;
+		sorted = msgs_final(old_msg_num);
+		error = sorted < 0;
 	}
 
-	/* index file is always fully rewritten */
-	if (!error) {
+	/* index file is fully rewritten only if it's new or re-sorted */
+	if (!error)
 		logtty("Processing finished, writing index...\n");
+
+	if (!error && old_links && !sorted) {
 		error = lock_fd(idx_fd, 0);
+
+		/* append new messages metadata */
+		if (!error) {
+			logtty("Writing new messages metadata...\n");
+			idx_size = write_msgs(idx_fd, old_msg_num);
+			error = idx_size < 0;
+		}
+
+		/* patch thread links and messages-per-day array, which makes
+		 * the new messages part of the index, so they go first */
+		if (!error) {
+			logtty("Updating thread links...\n");
+			error = write_changed_links(idx_fd, old_msg_num,
+			    old_links) || fsync(idx_fd);
+		}
+		if (!error) {
+			logtty("Updating messages index...\n");
+			error = write_changed_by_aday(idx_fd, old_by_aday);
+		}
+
+		/* the header goes last, once the rest is consistent */
+		if (!error) {
+			logtty("Writing header...\n");
+			error = idx_write_header(idx_fd, inc_ofs);
+		}
+	} else if (!error) {
+		/* write a new file and put it in place of the old one, if any,
+		 * so that the index is never seen incomplete */
+		new_fd = -1;
+		new_idx = concat(idx, NEW_FILENAME_SUFFIX, NULL);
+		if (new_idx)
+			new_fd = open(new_idx, O_CREAT | O_TRUNC | O_RDWR, 0644);
+		error = new_fd < 0 || lock_fd(new_fd, 0);
+
+		if (!error) {
+			logtty("Writing header...\n");
+			error = idx_write_header(new_fd, inc_ofs);
+		}
+
+		/* write messages-per-day array */
+		if (!error) {
+			logtty("Writing messages index...\n");
+			error = write_loop(new_fd, num_by_aday, sizeof(num_by_aday)) != sizeof(num_by_aday);
+		}
+
+		/* write messages metadata */
+		if (!error) {
+			logtty("Writing messages metadata...\n");
+			idx_size = write_msgs(new_fd, 0);
+			error = idx_size < 0;
+		}
+
+		if (!error)
+			error = fsync(new_fd) || rename(new_idx, idx);
+
+		if (!error) {
+			if (idx_fd >= 0)
+				close(idx_fd);
+			idx_fd = new_fd;
+		} else if (new_fd >= 0) {
+			unlink(new_idx);
+			close(new_fd);
+		}
+		free(new_idx);
 	}
+	free(idx);
+
+	free(old_by_aday);
+	free(old_links);
+
+	if (!error)
+		error = ftruncate(idx_fd, idx_size) != 0;
 
+	/* the tables are only good for an index we've written out fully */
+	links_close(error ? -1 : inc_ofs);
 	if (!error)
-		error = lseek(idx_fd, 0, SEEK_SET) != 0;
+		logtty("Done\n");
 
-	if (!error) {
-		logtty("Writing header...\n");
-		error = idx_write_header(idx_fd, inc_ofs);
+	/* keep the index in memory for the next call if requested, with all
+	 * of the rests now in the index file */
+	rests_reset(-1, 0, 0);
+	ckpt_close(!error);
+	free(fprints.name);
+	fprints.name = NULL;
+	free(fprints.fp.done);
+	fprints.fp.done = NULL;
+	fprints.fp.count = 0;
+	if (!error && mailbox_resident && !folder.path) {
+		for (i = 0; i < msg_num; i++)
+			msgs[i].rest = i;
+		resident_keep(mailbox, idx_fd, resident_ofs, inc_ofs);
+	} else {
+		resident_drop();
+	}
+	folder_close(&folder, !error);
+
+	if (idx_fd >= 0) {
+		error |= unlock_fd(idx_fd);
+		error |= close(idx_fd);
+	}
+
+	/* for an mbox, that's how much of the active segment it covers */
+	*offset = inc_ofs - active_base();
+	folder_close(&segments, 0);
+
+	return error;
+}
+
+/*
+ * Returns the mailbox size, or -1 on error.  A folder doesn't grow in size,
+ * so it's always 0.
+ */
+static off_t mailbox_size(const char *mailbox)
+{
+	struct stat st;
+
+	if (stat(mailbox, &st))
+		return -1;
+
+	return S_ISDIR(st.st_mode) ? 0 : st.st_size;
+}
+
+/*
+ * Only one of us updates the index of a mailbox at a time, holding a lock on
+ * the Message-ID and thread tables file (which only we use).  Others that
+ * find the lock held just leave the new messages to the one holding it, and
+ * that one keeps updating the index for as long as the mailbox grows.  This
+ * way, a burst of deliveries costs one or two index updates.
+ */
+int mailbox_parse(const char *mailbox)
+{
+	char *name;
+	off_t offset, last;
+	int error, status;
+
+	name = concat(mailbox, LINKS_FILENAME_SUFFIX, NULL);
+	if (!name)
+		return 1;
+	links.fd = open(name, O_CREAT | O_RDWR, 0644);
+	free(name);
+	if (links.fd < 0)
+		return 1;
+
+	status = trylock_fd(links.fd);
+	error = status < 0;
+	if (status > 0)
+		logtty("The index is being updated by another process\n");
+
+	last = -1;
+	while (!status) {
+		error = mailbox_update(mailbox, &offset);
+		if (error || offset == last)
+			break;
+		last = offset;
+		if (mailbox_size(mailbox) > offset)
+			continue;
+/* Deliveries after the check above would have found the lock held */
+		error = unlock_fd(links.fd);
+		if (error || mailbox_size(mailbox) <= offset)
+			break;
+		status = trylock_fd(links.fd);
+		error = status < 0;
+	}
+
+	error |= close(links.fd);
+	links.fd = -1;
+
+	if (error)
+		return 1;
+
+	return status > 0 && last < 0 ? MAILBOX_LOCKED : 0;
+}
+
+/* checks that the suffix won't make a segment's name one of our own files' */
+static int segment_suffix_ok(const char *suffix)
+{
+	static const char *ours[] = {
+		INDEX_FILENAME_SUFFIX, LINKS_FILENAME_SUFFIX,
+		NEW_FILENAME_SUFFIX, INDEX_FILENAME_SUFFIX NEW_FILENAME_SUFFIX,
+		CHECKPOINT_FILENAME_SUFFIX, FPRINTS_FILENAME_SUFFIX,
+		FILES_FILENAME_SUFFIX, NULL
+	};
+	const char **p;
+
+	if (!*suffix || strchr(suffix, '/') ||
+	    !strncmp(suffix, SPILL_FILENAME_SUFFIX + 1,
+	    sizeof(SPILL_FILENAME_SUFFIX) - 2))
+		return 0;
+	for (p = ours; *p; p++)
+		if (!strcmp(suffix, *p + 1))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * We rotate the mailbox with the Message-ID and thread tables file locked,
+ * like mailbox_parse() would have it, so that no one updates the index as
+ * we're at it, and with the mailbox itself locked, so that nothing is
+ * delivered to it meanwhile.  The mailbox is listed as a segment and linked
+ * to its new name before an empty one takes its place, so if we're
+ * interrupted, the next rotation completes the job.
+ */
+int mailbox_rotate(const char *mailbox, const char *suffix)
+{
+	struct stat st, seg_st;
+	char *name, *segment, *new_mailbox;
+	const char *p;
+	off_t offset;
+	int fd, new_fd, error, halfway = 0;
+
+	if (!segment_suffix_ok(suffix)) {
+		fprintf(stderr, "Invalid segment name suffix: %s\n", suffix);
+		return 1;
+	}
+
+	name = concat(mailbox, LINKS_FILENAME_SUFFIX, NULL);
+	segment = concat(mailbox, ".", suffix, NULL);
+	new_mailbox = concat(mailbox, NEW_FILENAME_SUFFIX, NULL);
+	links.fd = -1;
+	if (name && segment && new_mailbox)
+		links.fd = open(name, O_CREAT | O_RDWR, 0644);
+	free(name);
+	error = links.fd < 0 || lock_fd(links.fd, 0);
+
+/* Have the index cover all of the mailbox, with the mailbox locked after */
+	fd = -1;
+	while (!error) {
+		fd = open(mailbox, O_RDWR);
+		error = fd < 0 || folder_segments(&segments, mailbox);
+		halfway = !error && segment_is_active(fd);
+		folder_close(&segments, 0);
+		if (!error && !halfway)
+			error = mailbox_update(mailbox, &offset);
+		error = error || lock_fd(fd, 0) || fstat(fd, &st) ||
+		    !S_ISREG(st.st_mode);
+		if (error || halfway || st.st_size == offset)
+			break;
+		unlock_fd(fd);
+		close(fd);
+		fd = -1;
+	}
+
+/* Pick up where an interrupted rotation left off, if that's what it was */
+	p = segment ? strrchr(segment, '/') : NULL;
+	p = p ? p + 1 : segment;
+	if (!error && !(error = folder_segments(&segments, mailbox))) {
+		if (halfway) {
+			if (strcmp(folder_name(&segments, segments.count - 1),
+			    p)) {
+				fprintf(stderr, "Rotation to %s is incomplete\n",
+				    folder_name(&segments, segments.count - 1));
+				error = 1;
+			}
+		} else if (!lstat(segment, &seg_st)) {
+			fprintf(stderr, "%s already exists\n", segment);
+			error = 1;
+		} else if (errno != ENOENT) {
+			perror(segment);
+			error = 1;
+		} else {
+			error = folder_add(&segments, p);
+		}
+	}
+	folder_close(&segments, 0);
+
+	if (!error && link(mailbox, segment)) {
+		error = errno != EEXIST || stat(segment, &seg_st) ||
+		    seg_st.st_dev != st.st_dev || seg_st.st_ino != st.st_ino;
+		if (error)
+			perror(segment);
 	}
 
-	/* write messages-per-day array */
 	if (!error) {
-		logtty("Writing messages index...\n");
-		error = write_loop(idx_fd, num_by_aday, sizeof(num_by_aday)) != sizeof(num_by_aday);
+		new_fd = open(new_mailbox, O_CREAT | O_TRUNC | O_WRONLY,
+		    st.st_mode & 07777);
+		error = new_fd < 0;
+		if (!error) {
+			error = (fchown(new_fd, st.st_uid, st.st_gid) &&
+			    errno != EPERM) ||
+			    fchmod(new_fd, st.st_mode & 07777) ||
+			    fsync(new_fd);
+			error |= close(new_fd);
+		}
+		if (!error)
+			error = rename(new_mailbox, mailbox);
+		if (error)
+			perror(new_mailbox);
+	}
+
+	if (fd >= 0) {
+		error |= unlock_fd(fd);
+		error |= close(fd);
+	}
+
+/* The fingerprints were of what's now the segment */
+	if (!error && (name = concat(mailbox, FPRINTS_FILENAME_SUFFIX,
+	    NULL))) {
+		unlink(name);
+		free(name);
 	}
 
-	/* write messages metadata */
 	if (!error) {
-		logtty("Writing messages metadata...\n");
-		msgs_size = msg_num * sizeof(struct idx_message);
-		error = write_loop(idx_fd, msgs, msgs_size) != msgs_size;
+		logtty("Rotated to %s\n", p);
+		error = mailbox_update(mailbox, &offset);
 	}
 
-	free(msgs);
+	if (links.fd >= 0)
+		error |= close(links.fd);
+	links.fd = -1;
+	free(new_mailbox);
+	free(segment);
+
+	return error;
+}
 
+/*
+ * We compress the segment with the Message-ID and thread tables file locked,
+ * so that it isn't rotated to or compressed by someone else meanwhile.  The
+ * compressed file is written next to where the segment really is, such as
+ * on other storage that it's been moved to, and renamed over it once it's
+ * complete, so the segment is readable all along.
+ */
+int mailbox_compress(const char *mailbox, const char *suffix)
+{
+	struct stat st, mailbox_st, new_st;
+	char *name, *segment, *path, *new_path;
+	const char *p;
+	idx_off_t file;
+	int fd, new_fd, error;
+
+	name = concat(mailbox, LINKS_FILENAME_SUFFIX, NULL);
+	segment = concat(mailbox, ".", suffix, NULL);
+	links.fd = -1;
+	if (name && segment)
+		links.fd = open(name, O_CREAT | O_RDWR, 0644);
+	free(name);
+	error = links.fd < 0 || lock_fd(links.fd, 0) ||
+	    folder_segments(&segments, mailbox);
+
+/* Only an older segment that's been fully rotated to won't change */
+	p = segment ? strrchr(segment, '/') : NULL;
+	p = p ? p + 1 : segment;
+	path = NULL;
 	if (!error) {
-		idx_size = lseek(idx_fd, 0, SEEK_CUR);
-		error = idx_size == -1;
+		for (file = 0; file < segments.count; file++)
+			if (!strcmp(folder_name(&segments, file), p))
+				break;
+		if (file >= segments.count) {
+			fprintf(stderr, "%s is not a segment of the mailbox\n",
+			    p);
+			error = 1;
+		} else if (!(name = folder_segment_path(mailbox, p))) {
+			error = 1;
+		} else {
+			if (!(path = realpath(name, NULL)))
+				perror(name);
+			free(name);
+			error = !path;
+		}
 	}
+	folder_close(&segments, 0);
 
+	fd = -1;
 	if (!error) {
-		error = ftruncate(idx_fd, idx_size) != 0;
-		logtty("Done\n");
+		fd = open(path, O_RDONLY);
+		error = fd < 0 || fstat(fd, &st);
+		if (error)
+			perror(path);
+	}
+	if (!error && !stat(mailbox, &mailbox_st) &&
+	    st.st_dev == mailbox_st.st_dev && st.st_ino == mailbox_st.st_ino) {
+		fprintf(stderr, "Rotation to %s is incomplete\n", p);
+		error = 1;
+	}
+	if (!error && (error = zfile_compressed(fd))) {
+		if (error > 0) {
+			logtty("%s is compressed already\n", p);
+			error = 0;
+		} else {
+			fprintf(stderr, "%s is corrupt\n", path);
+		}
+		close(fd);
+		fd = -1;
 	}
 
-	if (idx_fd >= 0) {
-		error |= unlock_fd(idx_fd);
-		error |= close(idx_fd);
+	new_path = NULL;
+	if (!error && fd >= 0) {
+		new_path = concat(path, NEW_FILENAME_SUFFIX, NULL);
+		new_fd = new_path ? open(new_path,
+		    O_CREAT | O_TRUNC | O_WRONLY, st.st_mode & 07777) : -1;
+		error = new_fd < 0;
+		if (!error) {
+			logtty("Compressing %s...\n", p);
+			error = (fchown(new_fd, st.st_uid, st.st_gid) &&
+			    errno != EPERM) ||
+			    fchmod(new_fd, st.st_mode & 07777) ||
+			    zfile_compress(fd, new_fd) ||
+			    fstat(new_fd, &new_st) || fsync(new_fd);
+			error |= close(new_fd);
+			if (!error)
+				error = rename(new_path, path);
+			else
+				unlink(new_path);
+		}
+		if (error)
+			perror(new_path ? new_path : path);
+		else
+			logtty("Compressed %s from %llu to %llu bytes\n", p,
+			    (unsigned long long)st.st_size,
+			    (unsigned long long)new_st.st_size);
 	}
 
+	if (fd >= 0)
+		error |= close(fd);
+	if (links.fd >= 0)
+		error |= close(links.fd);
+	links.fd = -1;
+	free(new_path);
+	free(path);
+	free(segment);
+
 	return error;
 }
+
+/*
+ * Reads a message from fd into malloc(3)'ed memory, in mbox format: with a
+ * "From " line (unless it already starts with one), with any other lines
+ * that start with "From " quoted with '>', and with a blank line at the end.
+ * Leaves 2 bytes at the start for a blank line to go before the message.
+ * Returns the size, with *message set, or -1 on error.
+ */
+static ssize_t message_read(int fd, char **message)
+{
+	char *in, *out, *p, *q, *new;
+	char from[0x100];
+	const char *sender, *date;
+	size_t size, alloc, extra;
+	ssize_t block;
+	time_t now;
+
+	size = 0;
+	alloc = FILE_BUFFER_SIZE;
+	if (!(in = malloc(alloc)))
+		return -1;
+	while ((block = read_loop(fd, in + size, alloc - size)) > 0) {
+		size += block;
+		if (size < alloc)
+			break;
+		if (alloc > MAX_MAILBOX_BYTES / 2 ||
+		    !(new = realloc(in, alloc <<= 1))) {
+			block = -1;
+			break;
+		}
+		in = new;
+	}
+	if (block < 0) {
+		free(in);
+		return -1;
+	}
+
+	from[0] = '\0';
+	if (size < 5 || memcmp(in, "From ", 5)) {
+		sender = getenv("SENDER");
+		if (!sender || !*sender || strpbrk(sender, " \t\n") ||
+		    strlen(sender) > 0x80)
+			sender = "MAILER-DAEMON";
+		time(&now);
+		date = ctime(&now);
+		if (!date)
+			date = "Thu Jan  1 00:00:00 1970\n";
+		snprintf(from, sizeof(from), "From %s %s", sender, date);
+	}
+
+/* Count the lines to quote, and what else we'll add */
+	extra = 2 + strlen(from) + 2;
+	for (p = in; p < in + size; p = q + 1) {
+		if (p > in && in + size - p >= 5 && !memcmp(p, "From ", 5))
+			extra++;
+		if (!(q = memchr(p, '\n', in + size - p)))
+			break;
+	}
+
+	if (!(out = malloc(size + extra))) {
+		free(in);
+		return -1;
+	}
+
+	memcpy(out, "\n\n", 2);
+	q = out + 2;
+	q += strlen(strcpy(q, from));
+	for (p = in; p < in + size; p += block) {
+		if (p > in && in + size - p >= 5 && !memcmp(p, "From ", 5))
+			*q++ = '>';
+		new = memchr(p, '\n', in + size - p);
+		block = new ? new + 1 - p : in + size - p;
+		memcpy(q, p, block);
+		q += block;
+	}
+	if (q[-1] != '\n')
+		*q++ = '\n';
+	*q++ = '\n';
+
+	free(in);
+
+	*message = out;
+	return q - out;
+}
+
+int mailbox_deliver(const char *mailbox, int fd)
+{
+	struct stat st, path_st;
+	char *message, tail[2];
+	ssize_t size;
+	size_t skip;
+	int mbox_fd, error, rotated;
+
+	if ((size = message_read(fd, &message)) < 0)
+		return -1;
+
+/* The mailbox may have been rotated as we were waiting for the lock */
+	do {
+		mbox_fd = open(mailbox, O_RDWR | O_APPEND | O_CREAT, 0644);
+		if (mbox_fd < 0) {
+			free(message);
+			return -1;
+		}
+
+		error = lock_fd(mbox_fd, 0);
+		if (!error)
+			error = fstat(mbox_fd, &st);
+		rotated = !error && (stat(mailbox, &path_st) ||
+		    path_st.st_dev != st.st_dev ||
+		    path_st.st_ino != st.st_ino);
+		if (rotated) {
+			unlock_fd(mbox_fd);
+			close(mbox_fd);
+		}
+	} while (rotated);
+
+/* Skip as much of the blank line before the message as we don't need */
+	skip = 2;
+	if (!error && st.st_size > 0) {
+		if (st.st_size < 2 ||
+		    pread(mbox_fd, tail, 2, st.st_size - 2) != 2)
+			skip = 0;
+		else if (tail[1] == '\n')
+			skip = tail[0] == '\n' ? 2 : 1;
+		else
+			skip = 0;
+	}
+
+	if (!error) {
+		size -= skip;
+		if (write_loop(mbox_fd, message + skip, size) != size ||
+		    fsync(mbox_fd)) {
+			error = 1;
+			if (ftruncate(mbox_fd, st.st_size))
+				perror(mailbox);
+		}
+	}
+
+	error |= unlock_fd(mbox_fd);
+	error |= close(mbox_fd);
+	if (error) {
+		free(message);
+		return -1;
+	}
+
+/* Have the parser take the message from memory, and update the index */
+	delivered.data = message + skip;
+	delivered.offset = st.st_size;
+	delivered.size = size;
+	error = mailbox_parse(mailbox);
+	delivered.data = NULL;
+
+	free(message);
+
+/* The one holding the lock will index the message along with the rest */
+	return error == MAILBOX_LOCKED ? 0 : error;
+}
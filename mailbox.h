@@ -13,10 +13,53 @@
 #define _BLISTS_MAILBOX_H
 
 #define MSG_ALLOC_STEP			0x1000
+/* The average message size to presize msgs[] with for a new index */
+#define MSG_SIZE_GUESS			0x800
 
 /*
- * Opens, parses, and closes the mailbox.  Returns a non-zero value on error.
+ * The number of threads to parse the mailbox with.  The unindexed part of
+ * the mailbox is split into this many chunks at message boundaries, which
+ * are parsed in parallel; the resulting index is the same as with 1.
+ */
+extern int mailbox_threads;
+
+/*
+ * Whether to keep the index in memory after mailbox_parse(), so that the
+ * next call for the same mailbox doesn't need to read it back from the file
+ * (as long as the file hasn't been changed meanwhile).
+ */
+extern int mailbox_resident;
+
+/* mailbox_parse() found the index being updated by another process */
+#define MAILBOX_LOCKED			2
+
+/*
+ * Opens, parses, and closes the mailbox.  If another process is already
+ * updating its index, leaves the update to that process and returns
+ * MAILBOX_LOCKED.  Returns 1 on error, or 0 otherwise.
  */
 extern int mailbox_parse(const char *mailbox);
 
+/*
+ * Appends a message read from fd to the mailbox, and updates the index like
+ * mailbox_parse() does, without reading the message back from the mailbox.
+ * Returns -1 if the message could not be delivered, or a non-zero value if
+ * only the index update failed.
+ */
+extern int mailbox_deliver(const char *mailbox, int fd);
+
+/*
+ * Brings the index of the mbox up to date, and then renames the mbox to its
+ * name with a dot and the suffix appended, as its newest older segment, with
+ * an empty mbox taking its place.  Returns a non-zero value on error.
+ */
+extern int mailbox_rotate(const char *mailbox, const char *suffix);
+
+/*
+ * Compresses the older segment of the mbox that it was rotated to with the
+ * suffix, in place, so that it takes less space and can still be read from
+ * at any offset.  Returns a non-zero value on error.
+ */
+extern int mailbox_compress(const char *mailbox, const char *suffix);
+
 #endif
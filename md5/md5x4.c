@@ -0,0 +1,200 @@
+/*
+ * MD5 of several short messages at once, in the lanes of SIMD vectors.
+ * See md5x4.h for the description.
+ *
+ * This uses the GNU C vector extensions, which give SSE2 code on x86-64
+ * (4 lanes of 32 bits), NEON on ARM, and so on; the round functions are the
+ * same as in md5.c.  Each message is padded into its own buffer, and lanes
+ * with fewer blocks than the longest message keep their state once done.
+ * Without the vector extensions, we just hash the messages one by one.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#include <string.h>
+
+#include "md5.h"
+#include "md5x4.h"
+
+#if defined(__GNUC__) && MD5_X4_LANES == 4
+
+typedef unsigned int md5_vec __attribute__ ((vector_size (16)));
+
+#define F(x, y, z)			((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)			((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z)			(((x) ^ (y)) ^ (z))
+#define H2(x, y, z)			((x) ^ ((y) ^ (z)))
+#define I(x, y, z)			((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+	(a) += f((b), (c), (d)) + (x) + (t); \
+	(a) = ((a) << (s)) | ((a) >> (32 - (s))); \
+	(a) += (b);
+
+static inline unsigned int get32(const unsigned char *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+	    ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline void put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void MD5_x4(unsigned char result[MD5_X4_LANES][16],
+    const void *const data[MD5_X4_LANES],
+    const unsigned long size[MD5_X4_LANES])
+{
+	unsigned char buffer[MD5_X4_LANES][MD5_X4_MAX_BLOCKS * 64], *ptr;
+	int blocks[MD5_X4_LANES], max, i, n;
+	unsigned long bits;
+	md5_vec x[16], mask, a, b, c, d, saved_a, saved_b, saved_c, saved_d;
+
+	max = 1;
+	for (i = 0; i < MD5_X4_LANES; i++) {
+		blocks[i] = MD5_X4_BLOCKS(size[i]);
+		if (blocks[i] > max)
+			max = blocks[i];
+	}
+
+	for (i = 0; i < MD5_X4_LANES; i++) {
+		ptr = buffer[i];
+		memcpy(ptr, data[i], size[i]);
+		ptr[size[i]] = 0x80;
+		memset(&ptr[size[i] + 1], 0, max * 64 - size[i] - 1);
+		bits = size[i] << 3;
+		put32(&ptr[blocks[i] * 64 - 8], bits);
+		put32(&ptr[blocks[i] * 64 - 4], 0);
+	}
+
+	a = (md5_vec){0x67452301, 0x67452301, 0x67452301, 0x67452301};
+	b = (md5_vec){0xefcdab89, 0xefcdab89, 0xefcdab89, 0xefcdab89};
+	c = (md5_vec){0x98badcfe, 0x98badcfe, 0x98badcfe, 0x98badcfe};
+	d = (md5_vec){0x10325476, 0x10325476, 0x10325476, 0x10325476};
+
+	for (n = 0; n < max; n++) {
+		for (i = 0; i < 16; i++) {
+			ptr = &buffer[0][n * 64 + i * 4];
+			x[i] = (md5_vec){get32(ptr), get32(ptr + sizeof(*buffer)),
+			    get32(ptr + 2 * sizeof(*buffer)),
+			    get32(ptr + 3 * sizeof(*buffer))};
+		}
+		mask = (md5_vec){-(n < blocks[0]), -(n < blocks[1]),
+		    -(n < blocks[2]), -(n < blocks[3])};
+
+		saved_a = a;
+		saved_b = b;
+		saved_c = c;
+		saved_d = d;
+
+/* Round 1 */
+		STEP(F, a, b, c, d, x[0], 0xd76aa478, 7)
+		STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12)
+		STEP(F, c, d, a, b, x[2], 0x242070db, 17)
+		STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22)
+		STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7)
+		STEP(F, d, a, b, c, x[5], 0x4787c62a, 12)
+		STEP(F, c, d, a, b, x[6], 0xa8304613, 17)
+		STEP(F, b, c, d, a, x[7], 0xfd469501, 22)
+		STEP(F, a, b, c, d, x[8], 0x698098d8, 7)
+		STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12)
+		STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+		STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+		STEP(F, a, b, c, d, x[12], 0x6b901122, 7)
+		STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+		STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+		STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+/* Round 2 */
+		STEP(G, a, b, c, d, x[1], 0xf61e2562, 5)
+		STEP(G, d, a, b, c, x[6], 0xc040b340, 9)
+		STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+		STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20)
+		STEP(G, a, b, c, d, x[5], 0xd62f105d, 5)
+		STEP(G, d, a, b, c, x[10], 0x02441453, 9)
+		STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+		STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20)
+		STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5)
+		STEP(G, d, a, b, c, x[14], 0xc33707d6, 9)
+		STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14)
+		STEP(G, b, c, d, a, x[8], 0x455a14ed, 20)
+		STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5)
+		STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9)
+		STEP(G, c, d, a, b, x[7], 0x676f02d9, 14)
+		STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+/* Round 3 */
+		STEP(H, a, b, c, d, x[5], 0xfffa3942, 4)
+		STEP(H2, d, a, b, c, x[8], 0x8771f681, 11)
+		STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+		STEP(H2, b, c, d, a, x[14], 0xfde5380c, 23)
+		STEP(H, a, b, c, d, x[1], 0xa4beea44, 4)
+		STEP(H2, d, a, b, c, x[4], 0x4bdecfa9, 11)
+		STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16)
+		STEP(H2, b, c, d, a, x[10], 0xbebfbc70, 23)
+		STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4)
+		STEP(H2, d, a, b, c, x[0], 0xeaa127fa, 11)
+		STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16)
+		STEP(H2, b, c, d, a, x[6], 0x04881d05, 23)
+		STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4)
+		STEP(H2, d, a, b, c, x[12], 0xe6db99e5, 11)
+		STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+		STEP(H2, b, c, d, a, x[2], 0xc4ac5665, 23)
+
+/* Round 4 */
+		STEP(I, a, b, c, d, x[0], 0xf4292244, 6)
+		STEP(I, d, a, b, c, x[7], 0x432aff97, 10)
+		STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+		STEP(I, b, c, d, a, x[5], 0xfc93a039, 21)
+		STEP(I, a, b, c, d, x[12], 0x655b59c3, 6)
+		STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10)
+		STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+		STEP(I, b, c, d, a, x[1], 0x85845dd1, 21)
+		STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6)
+		STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+		STEP(I, c, d, a, b, x[6], 0xa3014314, 15)
+		STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+		STEP(I, a, b, c, d, x[4], 0xf7537e82, 6)
+		STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+		STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15)
+		STEP(I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+/* Lanes that are past their last block don't change */
+		a = saved_a + (a & mask);
+		b = saved_b + (b & mask);
+		c = saved_c + (c & mask);
+		d = saved_d + (d & mask);
+	}
+
+	for (i = 0; i < MD5_X4_LANES; i++) {
+		put32(&result[i][0], a[i]);
+		put32(&result[i][4], b[i]);
+		put32(&result[i][8], c[i]);
+		put32(&result[i][12], d[i]);
+	}
+}
+
+#else
+
+void MD5_x4(unsigned char result[MD5_X4_LANES][16],
+    const void *const data[MD5_X4_LANES],
+    const unsigned long size[MD5_X4_LANES])
+{
+	MD5_CTX ctx;
+	int i;
+
+	for (i = 0; i < MD5_X4_LANES; i++) {
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, data[i], size[i]);
+		MD5_Final(result[i], &ctx);
+	}
+}
+
+#endif
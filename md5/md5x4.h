@@ -0,0 +1,32 @@
+/*
+ * MD5 of several short messages at once, in the lanes of SIMD vectors.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#ifndef _MD5X4_H
+#define _MD5X4_H
+
+/*
+ * How many messages at a time, and how many 64-byte blocks they may take,
+ * which is what the message and its padding (at least 9 bytes) fit in.
+ */
+#define MD5_X4_LANES			4
+#define MD5_X4_MAX_BLOCKS		3
+#define MD5_X4_BLOCKS(size)		(((size) + 9 + 63) / 64)
+#define MD5_X4_MAX_SIZE			(MD5_X4_MAX_BLOCKS * 64 - 9)
+
+/*
+ * Computes the MD5 hashes of MD5_X4_LANES messages of up to MD5_X4_MAX_SIZE
+ * bytes each, same as MD5_Init(), MD5_Update() and MD5_Final() would for each
+ * of them.  Messages of different lengths may be mixed, but each pass
+ * takes as many blocks as the longest one needs.
+ */
+extern void MD5_x4(unsigned char result[MD5_X4_LANES][16],
+    const void *const data[MD5_X4_LANES],
+    const unsigned long size[MD5_X4_LANES]);
+
+#endif
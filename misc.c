@@ -11,6 +11,8 @@
  * There's ABSOLUTELY NO WARRANTY, express or implied.
  */
 
+#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE_EXTENDED
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -101,6 +103,26 @@ int lock_fd(int fd, int shared)
 	return 0;
 }
 
+int trylock_fd(int fd)
+{
+#if LOCK_FCNTL
+	struct flock l;
+
+	memset(&l, 0, sizeof(l));
+	l.l_whence = SEEK_SET;
+	l.l_type = F_WRLCK;
+	if (fcntl(fd, F_SETLK, &l))
+		return errno == EACCES || errno == EAGAIN ? 1 : -1;
+#endif
+
+#if LOCK_FLOCK
+	if (flock(fd, LOCK_EX | LOCK_NB))
+		return errno == EWOULDBLOCK ? 1 : -1;
+#endif
+
+	return 0;
+}
+
 int unlock_fd(int fd)
 {
 #if LOCK_FCNTL
@@ -207,3 +229,58 @@ char *concat(const char *s1, ...)
 	*p = 0;
 	return result;
 }
+
+/* returns the value of 2 decimal digits, or -1 if they aren't digits */
+static int from_date_2(const char *p)
+{
+	if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9')
+		return -1;
+	return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+const char *from_date(const char *p, size_t length, struct tm *tm)
+{
+	static const char wdays[] = "SunMonTueWedThuFriSat";
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	int wday, mon, mday, hour, min, sec, year;
+
+	if (length != 26 || p[0] != ' ' || p[4] != ' ' || p[8] != ' ' ||
+	    p[11] != ' ' || p[14] != ':' || p[17] != ':' || p[20] != ' ')
+		goto slow;
+
+	for (wday = 0; wday < 7; wday++)
+		if (!memcmp(p + 1, &wdays[wday * 3], 3))
+			break;
+	for (mon = 0; mon < 12; mon++)
+		if (!memcmp(p + 5, &months[mon * 3], 3))
+			break;
+	if (wday >= 7 || mon >= 12)
+		goto slow;
+
+/* The day of the month may be padded with a space or a zero */
+	if (p[9] == ' ')
+		mday = p[10] >= '0' && p[10] <= '9' ? p[10] - '0' : -1;
+	else
+		mday = from_date_2(p + 9);
+	hour = from_date_2(p + 12);
+	min = from_date_2(p + 15);
+	sec = from_date_2(p + 18);
+	year = from_date_2(p + 21);
+	if (mday < 1 || mday > 31 || hour < 0 || hour > 23 ||
+	    min < 0 || min > 59 || sec < 0 || sec > 59 ||
+	    year < 0 || from_date_2(p + 23) < 0)
+		goto slow;
+	year = year * 100 + from_date_2(p + 23);
+
+	tm->tm_wday = wday;
+	tm->tm_mon = mon;
+	tm->tm_mday = mday;
+	tm->tm_hour = hour;
+	tm->tm_min = min;
+	tm->tm_sec = sec;
+	tm->tm_year = year - 1900;
+	return p + 25;
+
+slow:
+	return strptime(p, " %a %b %d %T %Y", tm);
+}
@@ -14,6 +14,7 @@
 #define _BLISTS_MISC_H
 
 #include <sys/types.h>
+#include <time.h>
 
 /*
  * Obtain or remove a lock.
@@ -21,6 +22,12 @@
 extern int lock_fd(int fd, int shared);
 extern int unlock_fd(int fd);
 
+/*
+ * Attempts to obtain an exclusive lock without waiting.  Returns 0 on
+ * success, 1 if someone else holds a lock, or -1 on other errors.
+ */
+extern int trylock_fd(int fd);
+
 /*
  * Attempts to read until EOF, and returns the number of bytes read.
  * We don't expect any signals, so even EINTR is considered an error.
@@ -51,4 +58,13 @@ extern void logtty(const char *fmt, ...)
 
 extern void log_percentage(off_t offset, off_t size);
 
+/*
+ * Parses the date on a "From " line, which starts with the space at p and
+ * ends with the LF at p + length - 1.  The date is almost always exactly in
+ * the format asctime(3) produces, which we handle without strptime(3), as
+ * the latter is slow.  Anything else goes to strptime(3).  Returns whatever
+ * strptime(3) would, sets the same fields of *tm that it uses.
+ */
+extern const char *from_date(const char *p, size_t length, struct tm *tm);
+
 #endif
@@ -25,6 +25,62 @@
  */
 #define INDEX_FILENAME_SUFFIX		".idx"
 
+/*
+ * The suffix to append to a mailbox filename to form the name of the file
+ * where bindex keeps its Message-ID and thread tables between runs, so that
+ * it only needs to link new messages.  The CGI program doesn't use it.
+ */
+#define LINKS_FILENAME_SUFFIX		".links"
+
+/*
+ * The suffix to append to a mailbox filename, followed by 6 random chars, to
+ * form the names of temporary files where bindex keeps the new messages'
+ * offsets, sizes, and strings until it writes the index.  These files are
+ * removed right after they're created.
+ */
+#define SPILL_FILENAME_SUFFIX		".spill"
+
+/*
+ * The suffix to append to an index filename to form the name of the file
+ * where bindex writes a new index before renaming it over the old one.
+ */
+#define NEW_FILENAME_SUFFIX		".new"
+
+/*
+ * The suffix to append to a mailbox filename to form the name of the file
+ * where bindex saves its progress every CHECKPOINT_BYTES of the mailbox
+ * while indexing it from scratch, so that it can resume from there if it's
+ * interrupted.  The file is removed once the index is written.
+ */
+#define CHECKPOINT_FILENAME_SUFFIX	".ckpt"
+#define CHECKPOINT_BYTES		(1024 * 1024 * 1024)
+
+/*
+ * The suffix to append to a mailbox filename to form the name of the file
+ * where bindex keeps fingerprints of the mailbox, one per FPRINT_BYTES, so
+ * that when messages are removed from the mailbox, it only needs to reindex
+ * it from the first region that has changed.
+ */
+#define FPRINTS_FILENAME_SUFFIX		".fprints"
+#define FPRINT_BYTES			(16 * 1024 * 1024)
+
+/*
+ * The suffix to append to the name of a Maildir or MH folder to form the
+ * name of the file where bindex lists the folder's files, so that the index
+ * can refer to them by number.  For an mbox that's been rotated, the file
+ * lists its older segments instead.  The CGI program reads it too.
+ */
+#define FILES_FILENAME_SUFFIX		".files"
+
+/*
+ * How much of an older segment of a rotated mbox to compress into each zlib
+ * frame with bindex -z, and at what level.  A message is read by only
+ * decompressing the frames it overlaps, so larger frames compress better
+ * but make reading any one message slower.
+ */
+#define ZFILE_FRAME_BYTES		(1024 * 1024)
+#define ZFILE_LEVEL			9
+
 /*
  * Maximum message size in bytes (longer ones are truncated at this size).
  */
@@ -56,6 +112,7 @@
  * a single huge mailbox from stopping the entire service.
  * Well, that was the original intent; these got insane for blists, which
  * does incremental index updates and supports 64-bit file offsets now.
+ * For an mbox that's been rotated, the byte limit is per segment.
  */
 #define MAX_MAILBOX_MESSAGES		(100 * 1000 * 1000)
 #define MAX_MAILBOX_BYTES		(100ULL * 1024 * 1024 * 1024)
@@ -69,11 +126,48 @@
 #define LOCK_FCNTL			1
 #define LOCK_FLOCK			0
 
+/*
+ * With bindex -w, once a mailbox changes, we wait for it to stay unchanged
+ * for WATCH_QUIET_MS milliseconds, but no longer than WATCH_DELAY_MS in
+ * total, before updating its index.  This coalesces bursts of deliveries.
+ */
+#define WATCH_QUIET_MS			100
+#define WATCH_DELAY_MS			1000
+
 /*
  * File buffer size to use while parsing the mailbox.  Can be changed.
  */
 #define FILE_BUFFER_SIZE		0x10000
 
+/*
+ * Whether to map the mailbox into memory with mmap(2) while parsing it,
+ * which saves copying the data into the file buffer, and how much of the
+ * mailbox to map at a time (must be a multiple of the page size).  We fall
+ * back to read(2) if mmap(2) fails.
+ */
+#define MAILBOX_MMAP			1
+#define MAILBOX_MMAP_WINDOW		0x4000000
+
+/*
+ * How far ahead of the parser to have the kernel read the mailbox, with
+ * posix_fadvise(2), so that reading from the disk overlaps with parsing what
+ * has been read.  This may help with slow or high-latency storage (rotating
+ * disks, network filesystems), where it's best set to a few times
+ * MAILBOX_MMAP_WINDOW.  With 0, this is left to the kernel's own readahead,
+ * which is usually as good or better with local SSDs.
+ */
+#define MAILBOX_READAHEAD		0
+
+/*
+ * How many reads of FILE_BUFFER_SIZE bytes to keep in flight with io_uring
+ * where we read the mailbox rather than map it, and how many blocks of the
+ * index file to keep being written while we prepare the next one.  Like
+ * MAILBOX_READAHEAD, this may help with high-latency storage, where 8 or so
+ * is reasonable.  With 0, we use plain system calls, which we also fall back
+ * to when io_uring isn't available.
+ */
+#define MAILBOX_URING			0
+
 /*
  * The mailbox parsing code isn't allowed to truncate lines earlier than
  * this length.  Keep this at least as large as the longest header line
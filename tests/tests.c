@@ -10,22 +10,36 @@
  * There's ABSOLUTELY NO WARRANTY, express or implied.
  */
 
+#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE_EXTENDED
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
 #include <err.h>
 
 #include "../buffer.h"
 #include "../encoding.h"
 #include "../mime.h"
 #include "../misc.h"
+#include "../zfile.h"
+#include "../md5/md5.h"
+#include "../md5/md5x4.h"
 
 #include "../buffer.c"
 #include "../encoding.c"
 #include "../mime.c"
 #include "../misc.c"
+#include "../zfile.c"
+#include "../md5/md5.c"
+#undef STEP /* md5x4.c has its own, on vectors */
+#include "../md5/md5x4.c"
 
 static void test_decode_header(char *istr, char *ostr)
 {
@@ -233,6 +247,177 @@ static void test_process_header()
 	buffer_free(&dst);
 }
 
+/*
+ * Checks from_date() against strptime(3) on asctime(3) style dates, and on
+ * variations that it leaves to strptime(3).  Only the fields from_date()
+ * sets on its own are compared.
+ */
+static void test_from_date_one(const char *line)
+{
+	struct tm tm1, tm2;
+	const char *p1, *p2;
+
+	memset(&tm1, 0x55, sizeof(tm1));
+	memset(&tm2, 0x55, sizeof(tm2));
+	p1 = from_date(line, strlen(line), &tm1);
+	p2 = strptime(line, " %a %b %d %T %Y", &tm2);
+	if (p1 != p2)
+		errx(1, "  from_date() error (wrong end) on \"%s\"", line);
+	if (p1 && (tm1.tm_wday != tm2.tm_wday || tm1.tm_mon != tm2.tm_mon ||
+	    tm1.tm_mday != tm2.tm_mday || tm1.tm_hour != tm2.tm_hour ||
+	    tm1.tm_min != tm2.tm_min || tm1.tm_sec != tm2.tm_sec ||
+	    tm1.tm_year != tm2.tm_year))
+		errx(1, "  from_date() error (wrong date) on \"%s\"", line);
+}
+
+static void test_from_date(void)
+{
+	static const char *wdays[] =
+	    {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] =
+	    {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	static const int mdays[] = {0, 1, 9, 10, 29, 31, 32};
+	static const char *times[] =
+	    {"00:00:00", "23:59:59", "12:34:60", "24:00:00", "1:02:03"};
+	static const int years[] = {1970, 2000, 2025, 9999};
+	static const char *ends[] = {"\n", "\r\n"};
+	char line[64], *p;
+	unsigned int wday, mon, mday, pad, time, year, end, lower;
+	unsigned int count = 0;
+
+	printf(" Test from_date()\n");
+	for (wday = 0; wday < 7; wday++)
+	for (mon = 0; mon < 12; mon++)
+	for (mday = 0; mday < sizeof(mdays) / sizeof(mdays[0]); mday++)
+	for (pad = 0; pad < 2; pad++)
+	for (time = 0; time < sizeof(times) / sizeof(times[0]); time++)
+	for (year = 0; year < sizeof(years) / sizeof(years[0]); year++)
+	for (end = 0; end < 2; end++)
+	for (lower = 0; lower < 2; lower++) {
+		snprintf(line, sizeof(line), pad ? " %s %s %02d %s %d%s" :
+		    " %s %s %2d %s %d%s", wdays[wday], months[mon],
+		    mdays[mday], times[time], years[year], ends[end]);
+		if (lower)
+			for (p = line; *p; p++)
+				*p = tolower((unsigned char)*p);
+		test_from_date_one(line);
+		count++;
+	}
+
+	test_from_date_one(" Thu Jan  1 00:00:00 1970");
+	test_from_date_one(" Thu Jan  1 00:00:00 1970 \n");
+	test_from_date_one(" Thu Jan 1 00:00:00 1970\n");
+	test_from_date_one(" Thu Jan  1 00:00:00 70\n");
+	test_from_date_one(" Thu, 01 Jan 1970 00:00:00 +0000\n");
+	printf("  %u dates OK\n", count + 5);
+}
+
+/*
+ * Checks MD5_x4() against MD5_Init(), MD5_Update() and MD5_Final() for every
+ * message size it takes, with sizes needing different block counts mixed in
+ * each call.
+ */
+static void test_md5_x4(void)
+{
+	unsigned char msgs[MD5_X4_LANES][MD5_X4_MAX_SIZE];
+	unsigned char result[MD5_X4_LANES][16], expected[16];
+	const void *data[MD5_X4_LANES];
+	unsigned long size[MD5_X4_LANES];
+	MD5_CTX ctx;
+	unsigned int i, j, k;
+
+	printf(" Test MD5_x4()\n");
+	for (j = 0; j < MD5_X4_LANES; j++) {
+		for (k = 0; k < MD5_X4_MAX_SIZE; k++)
+			msgs[j][k] = k * 7 + j * 131 + (k >> 3);
+		data[j] = msgs[j];
+	}
+
+	for (i = 0; i <= MD5_X4_MAX_SIZE; i++) {
+		for (j = 0; j < MD5_X4_LANES; j++)
+			size[j] = (i + j * 61) % (MD5_X4_MAX_SIZE + 1);
+		MD5_x4(result, data, size);
+		for (j = 0; j < MD5_X4_LANES; j++) {
+			MD5_Init(&ctx);
+			MD5_Update(&ctx, msgs[j], size[j]);
+			MD5_Final(expected, &ctx);
+			if (memcmp(result[j], expected, sizeof(expected)))
+				errx(1, "  MD5_x4() error (lane %u, size %lu)",
+				    j, size[j]);
+		}
+	}
+}
+
+/*
+ * Reads a range of the data back from the compressed file, which may run
+ * past the end of the data, and checks it against the original.
+ */
+static void test_zfile_read(int fd, const char *data, off_t size,
+    off_t offset, size_t count)
+{
+	static char buffer[3 * ZFILE_FRAME_BYTES];
+	ssize_t expected;
+
+	expected = offset < size ? size - offset : 0;
+	if (expected > count)
+		expected = count;
+	if (zfile_pread(fd, buffer, count, offset) != expected ||
+	    memcmp(buffer, data + offset, expected))
+		errx(1, "  zfile_pread() error (%llu bytes at %llu)",
+		    (unsigned long long)count, (unsigned long long)offset);
+}
+
+static void test_zfile(void)
+{
+	const off_t frame = ZFILE_FRAME_BYTES, size = 2 * frame + 12345;
+	char *data;
+	FILE *in, *out;
+	off_t i;
+	unsigned int x;
+
+	printf(" Test zfile_compress() and zfile_pread()\n");
+	if (!(data = malloc(size)))
+		errx(1, "  malloc() error");
+
+/* Something that does compress, but not into nothing */
+	for (i = 0, x = 1; i < size; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = i % 64 == 63 ? '\n' : 'a' + (x >> 16) % 8;
+	}
+
+	if (!(in = tmpfile()) || !(out = tmpfile()) ||
+	    write_loop(fileno(in), data, size) != size ||
+	    lseek(fileno(in), 0, SEEK_SET) != 0 ||
+	    zfile_compress(fileno(in), fileno(out)))
+		errx(1, "  zfile_compress() error");
+	if (zfile_compressed(fileno(out)) != 1 ||
+	    zfile_compressed(fileno(in)) != 0)
+		errx(1, "  zfile_compressed() error");
+
+	test_zfile_read(fileno(out), data, size, 0, 1);
+	test_zfile_read(fileno(out), data, size, 0, 4096);
+	test_zfile_read(fileno(out), data, size, 0, size);
+	for (i = frame; i < size; i += frame) {
+		test_zfile_read(fileno(out), data, size, i - 1, 2);
+		test_zfile_read(fileno(out), data, size, i - 1000, 3000);
+		test_zfile_read(fileno(out), data, size, i, 100);
+	}
+	test_zfile_read(fileno(out), data, size, frame / 2, frame + 100);
+	test_zfile_read(fileno(out), data, size, frame / 2, 2 * frame);
+	test_zfile_read(fileno(out), data, size, size - 10, 100);
+	test_zfile_read(fileno(out), data, size, size, 10);
+	test_zfile_read(fileno(out), data, size, size + 5, 10);
+
+/* Plain files are read as they are */
+	test_zfile_read(fileno(in), data, size, frame - 1, 2);
+	test_zfile_read(fileno(in), data, size, size - 10, 100);
+
+	fclose(out);
+	fclose(in);
+	free(data);
+}
+
 static void test_multipart()
 {
 	struct buffer src;
@@ -344,6 +529,9 @@ int main(void)
 	test_encoded_words();
 	test_process_header();
 	test_multipart();
+	test_from_date();
+	test_md5_x4();
+	test_zfile();
 	printf("Success\n");
 	return 0;
 }
@@ -0,0 +1,307 @@
+/*
+ * Positioned reads and writes on a Linux io_uring, several at a time.
+ * See uring.h for the descriptions.
+ *
+ * We use the system calls directly rather than liburing, so there's nothing
+ * more to build against than the kernel headers.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#include <stdlib.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#endif
+
+/* IORING_OP_READ and IORING_OP_WRITE came along with this, in Linux 5.6 */
+#ifdef IORING_FEAT_RW_CUR_POS
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+/* Where a request is at */
+#define SLOT_FREE			0
+#define SLOT_BUSY			1
+#define SLOT_DONE			2
+
+struct uring {
+	int fd;
+	unsigned int slots;
+	void *sq_map, *cq_map;		/* The rings, maybe one mapping */
+	size_t sq_map_size, cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int queued;		/* Requests not submitted yet */
+	unsigned char *state;		/* SLOT_* for each slot */
+	int *result;			/* Results of SLOT_DONE ones */
+};
+
+static void uring_free(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring->state);
+	free(ring->result);
+	free(ring);
+}
+
+static void *uring_map(int fd, size_t size, off_t offset)
+{
+	void *map;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return map == MAP_FAILED ? NULL : map;
+}
+
+struct uring *uring_open(unsigned int slots)
+{
+	struct uring *ring;
+	struct io_uring_params p;
+
+	if (!slots || !(ring = calloc(1, sizeof(*ring))))
+		return NULL;
+	ring->slots = slots;
+	ring->state = calloc(slots, sizeof(*ring->state));
+	ring->result = calloc(slots, sizeof(*ring->result));
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, slots, &p);
+	if (!ring->state || !ring->result || ring->fd < 0 ||
+	    !(p.features & IORING_FEAT_RW_CUR_POS)) {
+		uring_free(ring);
+		return NULL;
+	}
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->sq_map_size < ring->cq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->sq_map = ring->cq_map = uring_map(ring->fd,
+		    ring->sq_map_size, IORING_OFF_SQ_RING);
+	} else {
+		ring->sq_map = uring_map(ring->fd, ring->sq_map_size,
+		    IORING_OFF_SQ_RING);
+		if (ring->sq_map)
+			ring->cq_map = uring_map(ring->fd, ring->cq_map_size,
+			    IORING_OFF_CQ_RING);
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (ring->cq_map)
+		ring->sqes = uring_map(ring->fd, ring->sqes_size,
+		    IORING_OFF_SQES);
+	if (!ring->sqes) {
+		uring_free(ring);
+		return NULL;
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_map + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_map + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((char *)ring->sq_map +
+	    p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_map +
+	    p.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_map + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_map + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((char *)ring->cq_map +
+	    p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map +
+	    p.cq_off.cqes);
+
+	return ring;
+}
+
+static int uring_queue(struct uring *ring, unsigned int slot, int op,
+    int fd, const void *buffer, size_t count, off_t offset)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	if (slot >= ring->slots || ring->state[slot] == SLOT_BUSY ||
+	    count > 0x7ffff000) {
+		errno = EINVAL;
+		return -1;
+	}
+
+/* We never have more requests in flight than slots, so there's room */
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long)buffer;
+	sqe->len = count;
+	sqe->user_data = slot;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->state[slot] = SLOT_BUSY;
+	ring->queued++;
+
+	return 0;
+}
+
+int uring_read(struct uring *ring, unsigned int slot, int fd,
+    void *buffer, size_t count, off_t offset)
+{
+	return uring_queue(ring, slot, IORING_OP_READ, fd, buffer, count,
+	    offset);
+}
+
+int uring_write(struct uring *ring, unsigned int slot, int fd,
+    const void *buffer, size_t count, off_t offset)
+{
+	return uring_queue(ring, slot, IORING_OP_WRITE, fd, buffer, count,
+	    offset);
+}
+
+/* submits what's queued, and waits for at least one completion if asked */
+static int uring_enter(struct uring *ring, int wait)
+{
+	int n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, ring->fd, ring->queued,
+		    wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+
+	ring->queued -= n;
+	return 0;
+}
+
+int uring_submit(struct uring *ring)
+{
+	return ring->queued ? uring_enter(ring, 0) : 0;
+}
+
+/* moves the completions from the ring to the slots */
+static void uring_reap(struct uring *ring)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		if (cqe->user_data < ring->slots) {
+			ring->state[cqe->user_data] = SLOT_DONE;
+			ring->result[cqe->user_data] = cqe->res;
+		}
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+ssize_t uring_wait(struct uring *ring, unsigned int slot)
+{
+	if (slot >= ring->slots || ring->state[slot] == SLOT_FREE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uring_reap(ring);
+	while (ring->state[slot] != SLOT_DONE) {
+		if (uring_enter(ring, 1))
+			return -1;
+		uring_reap(ring);
+	}
+
+	ring->state[slot] = SLOT_FREE;
+	if (ring->result[slot] < 0) {
+		errno = -ring->result[slot];
+		return -1;
+	}
+
+	return ring->result[slot];
+}
+
+void uring_close(struct uring *ring)
+{
+	unsigned int slot;
+
+	for (slot = 0; slot < ring->slots; slot++)
+		if (ring->state[slot] != SLOT_FREE)
+			uring_wait(ring, slot);
+
+	uring_free(ring);
+}
+
+#else
+
+struct uring *uring_open(unsigned int slots)
+{
+	(void)slots;
+	return NULL;
+}
+
+int uring_read(struct uring *ring, unsigned int slot, int fd,
+    void *buffer, size_t count, off_t offset)
+{
+	(void)ring;
+	(void)slot;
+	(void)fd;
+	(void)buffer;
+	(void)count;
+	(void)offset;
+	return -1;
+}
+
+int uring_write(struct uring *ring, unsigned int slot, int fd,
+    const void *buffer, size_t count, off_t offset)
+{
+	(void)ring;
+	(void)slot;
+	(void)fd;
+	(void)buffer;
+	(void)count;
+	(void)offset;
+	return -1;
+}
+
+int uring_submit(struct uring *ring)
+{
+	(void)ring;
+	return -1;
+}
+
+ssize_t uring_wait(struct uring *ring, unsigned int slot)
+{
+	(void)ring;
+	(void)slot;
+	return -1;
+}
+
+void uring_close(struct uring *ring)
+{
+	(void)ring;
+}
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Positioned reads and writes on a Linux io_uring, several at a time.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#ifndef _BLISTS_URING_H
+#define _BLISTS_URING_H
+
+#include <sys/types.h>
+
+struct uring;
+
+/*
+ * Sets up a ring for up to slots requests in flight at a time.  Returns NULL
+ * if io_uring isn't available (not Linux, too old a kernel, disabled, or out
+ * of resources), for the caller to use plain system calls instead.
+ */
+extern struct uring *uring_open(unsigned int slots);
+
+/*
+ * Queue a pread(2) or pwrite(2) of count bytes as request number slot, which
+ * must be less than the number of slots and not in flight.  The buffer must
+ * remain valid until the request completes.  Return 0, or -1 on error.
+ */
+extern int uring_read(struct uring *ring, unsigned int slot, int fd,
+    void *buffer, size_t count, off_t offset);
+extern int uring_write(struct uring *ring, unsigned int slot, int fd,
+    const void *buffer, size_t count, off_t offset);
+
+/*
+ * Submits whatever has been queued.  Returns 0, or -1 on error.
+ */
+extern int uring_submit(struct uring *ring);
+
+/*
+ * Submits whatever has been queued, waits for request number slot to
+ * complete, and returns what pread(2) or pwrite(2) would have, with errno
+ * set on error.
+ */
+extern ssize_t uring_wait(struct uring *ring, unsigned int slot);
+
+/*
+ * Waits for all requests in flight to complete, and frees the ring.
+ */
+extern void uring_close(struct uring *ring);
+
+#endif
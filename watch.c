@@ -0,0 +1,361 @@
+/*
+ * Watching a spool directory and keeping the indices up to date.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#include <stdio.h>
+
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+
+#include "params.h"
+#include "misc.h"
+#include "folder.h"
+#include "mailbox.h"
+
+#define EVENT_BUFFER_SIZE		0x1000
+
+/*
+ * The changes we watch mailboxes for.  The watchers' own inotify instances
+ * would run into the per-user limit on those (128 by default) for a large
+ * spool, so there's just one, in the parent, which tells each watcher of
+ * changes to its mailbox with these signals.
+ */
+#define WATCH_MASK \
+	(IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define SIGNAL_CHANGED			SIGUSR1
+#define SIGNAL_GONE			SIGUSR2
+
+/* A mailbox, its inotify watch, and the process keeping its index up to date */
+struct watcher {
+	char *name;
+	int wd;
+	pid_t pid;
+};
+
+static struct watcher *watchers;
+static int watcher_num, watcher_alloc;
+static sigset_t watch_signals;
+
+static int has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), m = strlen(suffix);
+
+	return n >= m && !strcmp(name + n - m, suffix);
+}
+
+/*
+ * Checks whether the file is on the list of older segments of a rotated mbox,
+ * which it's named after: the mbox's name, a dot, and a suffix.
+ */
+static int is_segment(const char *spool, const char *name)
+{
+	struct folder segments;
+	const char *p;
+	char *mailbox;
+	idx_off_t i;
+	int retval = 0;
+
+	for (p = strchr(name, '.'); p && !retval; p = strchr(p + 1, '.')) {
+		if (!(mailbox = concat(spool, "/", name, NULL)))
+			break;
+		mailbox[strlen(spool) + 1 + (p - name)] = '\0';
+		if (!folder_segments(&segments, mailbox)) {
+			for (i = 0; i < segments.count && !retval; i++)
+				retval = !strcmp(segments.files[i].name, name);
+			folder_close(&segments, 0);
+		}
+		free(mailbox);
+	}
+
+	return retval;
+}
+
+/* whether the spool directory entry looks like a mailbox */
+static int is_mailbox(const char *spool, const char *name)
+{
+	struct stat st;
+	char *path;
+	int retval;
+
+	if (name[0] == '.' ||
+	    has_suffix(name, INDEX_FILENAME_SUFFIX) ||
+	    has_suffix(name, LINKS_FILENAME_SUFFIX) ||
+	    has_suffix(name, NEW_FILENAME_SUFFIX) ||
+	    has_suffix(name, CHECKPOINT_FILENAME_SUFFIX) ||
+	    has_suffix(name, FPRINTS_FILENAME_SUFFIX) ||
+	    has_suffix(name, FILES_FILENAME_SUFFIX) ||
+	    strstr(name, SPILL_FILENAME_SUFFIX))
+		return 0;
+
+	path = concat(spool, "/", name, NULL);
+	if (!path)
+		return 0;
+	retval = !stat(path, &st) && S_ISREG(st.st_mode) &&
+	    !is_segment(spool, name);
+	free(path);
+
+	return retval;
+}
+
+/*
+ * Waits for up to timeout milliseconds (or forever if negative) for the
+ * parent to signal changes.  Returns 1 if there were changes, 0 on timeout,
+ * -1 on error, or 2 if the watched file is gone.
+ */
+static int wait_events(int timeout)
+{
+	struct timespec ts;
+	int sig;
+
+	if (timeout < 0) {
+		sig = sigwaitinfo(&watch_signals, NULL);
+	} else {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		sig = sigtimedwait(&watch_signals, NULL, &ts);
+	}
+	if (sig < 0)
+		return errno != EINTR && errno != EAGAIN ? -1 : 0;
+
+	return sig == SIGNAL_GONE ? 2 : 1;
+}
+
+/* checks whether the mailbox is no longer the file we've been watching */
+static int is_replaced(const char *mailbox, const struct stat *st)
+{
+	struct stat now;
+
+	return stat(mailbox, &now) ||
+	    now.st_dev != st->st_dev || now.st_ino != st->st_ino;
+}
+
+static long ms_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/*
+ * Keeps the index of one mailbox up to date, holding it in memory between
+ * updates.  st is what the mailbox was before the parent started watching
+ * it.  Returns when the mailbox is removed, renamed, or replaced (as it is
+ * when it's rotated), or on error.
+ */
+static int watch_mailbox(const char *mailbox, struct stat *st)
+{
+	struct timeval start;
+	int status;
+
+	mailbox_resident = 1;
+	status = 1;
+	do {
+		if (mailbox_parse(mailbox) == 1)
+			fprintf(stderr, "Failed to parse the mailbox or/and "
+			    "its index file: %s\n", mailbox);
+
+		status = 2;
+		while (!is_replaced(mailbox, st) &&
+		    !(status = wait_events(-1)))
+			;
+		if (status != 1)
+			break;
+
+/* Let a burst of deliveries complete before we update the index */
+		gettimeofday(&start, NULL);
+		while (ms_since(&start) < WATCH_DELAY_MS &&
+		    (status = wait_events(WATCH_QUIET_MS)) == 1)
+			;
+	} while (status >= 0 && status != 2);
+
+	return status < 0;
+}
+
+static void watcher_start(int fd, const char *spool, const char *name)
+{
+	struct watcher *w;
+	struct stat st;
+	char *mailbox;
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < watcher_num; i++)
+		if (!strcmp(watchers[i].name, name))
+			return;
+
+	if (watcher_num >= watcher_alloc) {
+		w = realloc(watchers, (watcher_alloc + 0x100) * sizeof(*w));
+		if (!w)
+			return;
+		watchers = w;
+		watcher_alloc += 0x100;
+	}
+	w = &watchers[watcher_num];
+	if (!(mailbox = concat(spool, "/", name, NULL)))
+		return;
+	if (!(w->name = strdup(name))) {
+		free(mailbox);
+		return;
+	}
+
+/* If it's replaced after we've looked, the watcher will restart right away */
+	if (stat(mailbox, &st))
+		memset(&st, 0, sizeof(st));
+	if ((w->wd = inotify_add_watch(fd, mailbox, WATCH_MASK)) < 0) {
+		perror(mailbox);
+		free(w->name);
+		free(mailbox);
+		return;
+	}
+
+	fflush(stdout);
+	switch ((pid = fork())) {
+	case -1:
+		perror("fork");
+		inotify_rm_watch(fd, w->wd);
+		free(w->name);
+		free(mailbox);
+		return;
+	case 0:
+		close(fd);
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() == 1)
+			_exit(0);
+		_exit(watch_mailbox(mailbox, &st));
+	}
+
+	free(mailbox);
+	w->pid = pid;
+	watcher_num++;
+}
+
+/* tells the watchers of the inotify watch about the event */
+static void watchers_signal(const struct inotify_event *event)
+{
+	int i, sig;
+
+	sig = (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) ?
+	    SIGNAL_GONE : SIGNAL_CHANGED;
+	for (i = 0; i < watcher_num; i++)
+		if (watchers[i].wd == event->wd)
+			kill(watchers[i].pid, sig);
+}
+
+/* reaps the processes that have exited, restarting them if needed */
+static void watchers_reap(int fd, const char *spool)
+{
+	pid_t pid;
+	char *name;
+	int i, j;
+
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		for (i = 0; i < watcher_num; i++)
+			if (watchers[i].pid == pid)
+				break;
+		if (i >= watcher_num)
+			continue;
+		name = watchers[i].name;
+/* Hard links to the same mailbox share the watch */
+		for (j = 0; j < watcher_num; j++)
+			if (j != i && watchers[j].wd == watchers[i].wd)
+				break;
+		if (j >= watcher_num)
+			inotify_rm_watch(fd, watchers[i].wd);
+		watchers[i] = watchers[--watcher_num];
+/* The mailbox may have been replaced, or the process may have crashed */
+		if (is_mailbox(spool, name))
+			watcher_start(fd, spool, name);
+		free(name);
+	}
+}
+
+int watch_spool(const char *spool)
+{
+	char buffer[EVENT_BUFFER_SIZE]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	struct dirent *entry;
+	struct timeval tv;
+	fd_set fds;
+	DIR *dir;
+	ssize_t n;
+	char *p;
+	int fd, wd;
+
+/* Blocked here, the signals stay pending for the watchers to wait for */
+	sigemptyset(&watch_signals);
+	sigaddset(&watch_signals, SIGNAL_CHANGED);
+	sigaddset(&watch_signals, SIGNAL_GONE);
+	sigprocmask(SIG_BLOCK, &watch_signals, NULL);
+
+	fd = inotify_init();
+	if (fd < 0 || (wd = inotify_add_watch(fd, spool,
+	    IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)) < 0) {
+		perror(spool);
+		return 1;
+	}
+
+	if (!(dir = opendir(spool))) {
+		perror(spool);
+		return 1;
+	}
+	while ((entry = readdir(dir)))
+		if (is_mailbox(spool, entry->d_name))
+			watcher_start(fd, spool, entry->d_name);
+	closedir(dir);
+
+	while (1) {
+		watchers_reap(fd, spool);
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(fd + 1, &fds, NULL, NULL, &tv) > 0 &&
+		    (n = read(fd, buffer, sizeof(buffer))) > 0) {
+			for (p = buffer; p < buffer + n;
+			    p += sizeof(*event) + event->len) {
+				event = (struct inotify_event *)p;
+				if (event->wd != wd)
+					watchers_signal(event);
+				else if (event->len &&
+				    is_mailbox(spool, event->name))
+					watcher_start(fd, spool, event->name);
+			}
+		}
+	}
+
+	return 0;
+}
+
+#else
+
+int watch_spool(const char *spool)
+{
+	fprintf(stderr, "Watching %s: not supported on this system\n", spool);
+	return 1;
+}
+
+#endif
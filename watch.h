@@ -0,0 +1,21 @@
+/*
+ * Watching a spool directory and keeping the indices up to date.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#ifndef _BLISTS_WATCH_H
+#define _BLISTS_WATCH_H
+
+/*
+ * Keeps the indices of all mailboxes in the spool directory up to date,
+ * including those that appear later, with a process per mailbox which holds
+ * its index in memory.  One inotify instance watches them all.  Only returns
+ * on error (and is Linux-specific).
+ */
+extern int watch_spool(const char *spool);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Seekable compressed files.
+ * See zfile.h for the descriptions.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "params.h"
+#include "misc.h"
+#include "zfile.h"
+
+#define ZFILE_TAG "bzfile"
+#define ZFILE_REVISION 1
+#define ZFILE_ENDIANNESS 0x1234
+
+/*
+ * The header is followed by the frames, and then by the table, which has
+ * where each frame starts, and where the last one ends (that is, where the
+ * table starts).
+ */
+struct zfile_header {
+	char tag[6];
+	short revision;
+	short endianness;
+	off_t size;		/* Of the data, uncompressed */
+	off_t frame_bytes;	/* Of the data in a frame, but the last */
+	off_t table;
+};
+
+/* reads the header, returning 1 if the file is compressed, like above */
+static int zfile_header(int fd, struct zfile_header *h)
+{
+	ssize_t n;
+
+	n = pread(fd, h, sizeof(*h), 0);
+	if (n < 0)
+		return -1;
+	if (n != sizeof(*h) || memcmp(ZFILE_TAG, h->tag, sizeof(h->tag)))
+		return 0;
+	if (h->revision != ZFILE_REVISION ||
+	    h->endianness != ZFILE_ENDIANNESS ||
+	    h->size < 0 || h->frame_bytes < 1 ||
+	    h->frame_bytes > (1 << 30) || h->table < (off_t)sizeof(*h)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 1;
+}
+
+int zfile_compressed(int fd)
+{
+	struct zfile_header h;
+
+	return zfile_header(fd, &h);
+}
+
+/* inflates the next size bytes of a frame into out, or skips them if NULL */
+static int zfile_inflate(z_stream *z, char *out, size_t size)
+{
+	char discard[0x4000];
+	size_t block;
+	int status;
+
+	while (size) {
+		block = size;
+		if (!out && block > sizeof(discard))
+			block = sizeof(discard);
+		z->next_out = (Bytef *)(out ? out : discard);
+		z->avail_out = block;
+		do {
+			status = inflate(z, Z_NO_FLUSH);
+			if (status != Z_OK && (status != Z_STREAM_END ||
+			    z->avail_out))
+				return -1;
+		} while (z->avail_out);
+		if (out)
+			out += block;
+		size -= block;
+	}
+
+	return 0;
+}
+
+ssize_t zfile_pread(int fd, void *buffer, size_t count, off_t offset)
+{
+	struct zfile_header h;
+	z_stream z;
+	off_t *table, first, last, frame, start, end;
+	char *in, *out;
+	size_t n;
+	int error;
+
+	switch (zfile_header(fd, &h)) {
+	case 0:
+		if (lseek(fd, offset, SEEK_SET) != offset)
+			return -1;
+		return read_loop(fd, buffer, count);
+	case -1:
+		return -1;
+	}
+
+	if (offset < 0)
+		return -1;
+	if (offset >= h.size || !count)
+		return 0;
+	if (count > h.size - offset)
+		count = h.size - offset;
+
+/* Only the part of the table for the frames that we need */
+	first = offset / h.frame_bytes;
+	last = (offset + count - 1) / h.frame_bytes;
+	n = (last - first + 2) * sizeof(*table);
+	if (!(table = malloc(n)))
+		return -1;
+	if (pread(fd, table, n, h.table + first * sizeof(*table)) != n) {
+		free(table);
+		return -1;
+	}
+
+	memset(&z, 0, sizeof(z));
+	if (!(in = malloc(compressBound(h.frame_bytes))) ||
+	    inflateInit(&z) != Z_OK) {
+		free(in);
+		free(table);
+		return -1;
+	}
+
+	error = 0;
+	out = buffer;
+	for (frame = first; frame <= last && !error; frame++) {
+		n = table[frame - first + 1] - table[frame - first];
+		start = frame * h.frame_bytes;
+		end = start + h.frame_bytes;
+		if (start < offset)
+			start = offset;
+		if (end > offset + count)
+			end = offset + count;
+		error = table[frame - first + 1] <= table[frame - first] ||
+		    n > compressBound(h.frame_bytes) ||
+		    pread(fd, in, n, table[frame - first]) != n ||
+		    inflateReset(&z) != Z_OK;
+		if (error)
+			break;
+		z.next_in = (Bytef *)in;
+		z.avail_in = n;
+/* Stop once we have what we need, and skip over what we don't */
+		error = zfile_inflate(&z, NULL,
+		    start - frame * h.frame_bytes) ||
+		    zfile_inflate(&z, out, end - start);
+		out += end - start;
+	}
+
+	inflateEnd(&z);
+	free(in);
+	free(table);
+
+	return error ? -1 : (ssize_t)count;
+}
+
+int zfile_compress(int in_fd, int out_fd)
+{
+	struct zfile_header h;
+	struct stat st;
+	off_t *table, *new_table, offset;
+	char *in, *out, *check;
+	uLongf out_size, check_size;
+	size_t count, alloc;
+	ssize_t n;
+	int error;
+
+/* Without the tag until we're done */
+	memset(&h, 0, sizeof(h));
+	h.revision = ZFILE_REVISION;
+	h.endianness = ZFILE_ENDIANNESS;
+	h.frame_bytes = ZFILE_FRAME_BYTES;
+
+	table = NULL;
+	count = alloc = 0;
+	n = 0;
+	in = malloc(h.frame_bytes);
+	out = malloc(compressBound(h.frame_bytes));
+	check = malloc(h.frame_bytes);
+	error = !in || !out || !check ||
+	    write_loop(out_fd, &h, sizeof(h)) != sizeof(h);
+	offset = sizeof(h);
+
+	while (!error && (n = read_loop(in_fd, in, h.frame_bytes)) > 0) {
+		if (count + 2 > alloc) {
+			alloc += 0x1000;
+			if (!(new_table = realloc(table,
+			    alloc * sizeof(*table)))) {
+				error = 1;
+				break;
+			}
+			table = new_table;
+		}
+		table[count++] = offset;
+
+		out_size = compressBound(h.frame_bytes);
+		check_size = h.frame_bytes;
+		error = compress2((Bytef *)out, &out_size, (Bytef *)in, n,
+		    ZFILE_LEVEL) != Z_OK ||
+		    uncompress((Bytef *)check, &check_size, (Bytef *)out,
+		    out_size) != Z_OK ||
+		    check_size != n || memcmp(check, in, n) ||
+		    write_loop(out_fd, out, out_size) != out_size;
+		offset += out_size;
+		h.size += n;
+		if (!fstat(in_fd, &st))
+			log_percentage(h.size, st.st_size);
+		if (n < h.frame_bytes)
+			break;
+	}
+	if (!error && n < 0)
+		error = 1;
+
+	if (!error && !table && !(table = malloc(sizeof(*table))))
+		error = 1;
+	if (!error) {
+		table[count++] = offset;
+		h.table = offset;
+		memcpy(h.tag, ZFILE_TAG, sizeof(h.tag));
+		error = write_loop(out_fd, table, count * sizeof(*table)) !=
+		    count * sizeof(*table) ||
+		    pwrite(out_fd, &h, sizeof(h), 0) != sizeof(h);
+	}
+
+	free(check);
+	free(out);
+	free(in);
+	free(table);
+
+	return error ? -1 : 0;
+}
+
+int zfile_decompress(int in_fd, int out_fd)
+{
+	struct zfile_header h;
+	off_t table[2], frame, count;
+	char *in, *out;
+	uLongf out_size;
+	size_t n;
+	int error;
+
+	if (zfile_header(in_fd, &h) != 1)
+		return -1;
+
+	in = malloc(compressBound(h.frame_bytes));
+	out = malloc(h.frame_bytes);
+	error = !in || !out;
+	count = (h.size + h.frame_bytes - 1) / h.frame_bytes;
+	for (frame = 0; frame < count && !error; frame++) {
+		error = pread(in_fd, table, sizeof(table),
+		    h.table + frame * sizeof(*table)) != sizeof(table);
+		n = table[1] - table[0];
+		error = error || table[1] <= table[0] ||
+		    n > compressBound(h.frame_bytes) ||
+		    pread(in_fd, in, n, table[0]) != n;
+		if (error)
+			break;
+		out_size = h.frame_bytes;
+		if (frame == count - 1)
+			out_size = h.size - frame * h.frame_bytes;
+		n = out_size;
+		error = uncompress((Bytef *)out, &out_size, (Bytef *)in,
+		    table[1] - table[0]) != Z_OK || out_size != n ||
+		    write_loop(out_fd, out, n) != n;
+		log_percentage((frame + 1) * h.frame_bytes, h.size);
+	}
+
+	free(out);
+	free(in);
+
+	return error ? -1 : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Seekable compressed files: independent zlib frames of ZFILE_FRAME_BYTES
+ * of the data each, followed by a table of where the frames start, so that
+ * a range of the data can be read by only decompressing the frames that it
+ * overlaps.  Offsets into such a file are those into the uncompressed data.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted.
+ *
+ * There's ABSOLUTELY NO WARRANTY, express or implied.
+ */
+
+#ifndef _BLISTS_ZFILE_H
+#define _BLISTS_ZFILE_H
+
+#include <sys/types.h>
+
+/*
+ * Checks whether the file is compressed.  Returns 1 if it is, 0 if it's a
+ * plain file, or -1 if it looks compressed but is corrupt, or on error.
+ */
+extern int zfile_compressed(int fd);
+
+/*
+ * Reads up to count bytes at offset into the data, decompressing them if
+ * the file is compressed.  Returns the number of bytes read, which is less
+ * than count at the end of the data, or -1 on error.
+ */
+extern ssize_t zfile_pread(int fd, void *buffer, size_t count, off_t offset);
+
+/*
+ * Compresses what's left to read from in_fd into out_fd, which should be
+ * empty, checking that each frame decompresses back to the data.  Returns 0
+ * on success, or -1 on error.
+ */
+extern int zfile_compress(int in_fd, int out_fd);
+
+/*
+ * Decompresses all of the data in in_fd into out_fd.  Returns 0 on success,
+ * or -1 on error.
+ */
+extern int zfile_decompress(int in_fd, int out_fd);
+
+#endif